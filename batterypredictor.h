@@ -0,0 +1,135 @@
+#pragma once
+
+#include "window.h"
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <cmath>
+
+// Guesses how long until the battery is empty (or full) from how the energy
+// has actually been going the last few minutes, instead of the percentage
+// steps. The rate is the median of the slopes between every pair of samples
+// (Theil-Sen), so a few seconds of compiling or a sample that came in late
+// doesn't throw it off. Until there's enough history it goes by the
+// smoothed power the battery reports itself.
+struct BatteryPredictor {
+    // energy in µWh, power in µW (0 if the battery doesn't tell)
+    void add(uint64_t timeMs, double energy, double power, bool charging)
+    {
+        // Starting over, the old samples are going the other way
+        if (charging != wasCharging) {
+            clear();
+            wasCharging = charging;
+        }
+
+        if (power > 0) {
+            reported.add(power, haveReported ? timeMs - lastReportedMs : 0);
+            lastReportedMs = timeMs;
+            haveReported = true;
+        }
+
+        // The same values again if we're just run for something else
+        if (count && timeMs - samples[(first + count - 1) % capacity].timeMs < minSpacingMs) {
+            return;
+        }
+
+        if (count == capacity) {
+            first = (first + 1) % capacity;
+            count--;
+        }
+
+        samples[(first + count) % capacity] = { timeMs, energy };
+        count++;
+    }
+
+    // µW going in or out, 0 if we don't know yet (or it's going the wrong
+    // way, like when it's full)
+    double rate() const
+    {
+        if (count >= minSamples && at(count - 1).timeMs - at(0).timeMs >= minSpanMs) {
+            const double fitted = wasCharging ? theilSen() : -theilSen();
+
+            if (fitted > 0) {
+                return fitted;
+            }
+        }
+
+        return haveReported ? reported.value() : 0;
+    }
+
+    // Until empty, or until full when charging, -1 if we can't tell
+    int minutesLeft(double energy, double full) const
+    {
+        const double power = rate();
+
+        if (power <= 0 || full <= 0) {
+            return -1;
+        }
+
+        const double remaining = wasCharging ? full - energy : energy;
+        return int(std::max(remaining, 0.) / power * 60);
+    }
+
+    void clear()
+    {
+        count = 0;
+        first = 0;
+        reported.clear();
+        haveReported = false;
+    }
+
+    // Every sample over the last quarter of an hour, at most twice a minute
+    static constexpr unsigned capacity = 32;
+    static constexpr uint64_t minSpacingMs = 30000;
+
+    // Less than this and the percentage steps are all we'd see
+    static constexpr unsigned minSamples = 4;
+    static constexpr uint64_t minSpanMs = 120000;
+
+private:
+    struct Sample {
+        uint64_t timeMs;
+        double energy;
+    };
+
+    const Sample &at(unsigned index) const
+    {
+        return samples[(first + index) % capacity];
+    }
+
+    // µWh per ms to µW
+    double theilSen() const
+    {
+        double slopes[capacity * (capacity - 1) / 2];
+        unsigned slopeCount = 0;
+
+        for (unsigned i = 0; i < count; i++) {
+            for (unsigned j = i + 1; j < count; j++) {
+                const Sample &a = at(i);
+                const Sample &b = at(j);
+
+                if (b.timeMs > a.timeMs) {
+                    slopes[slopeCount++] = (b.energy - a.energy) / (b.timeMs - a.timeMs);
+                }
+            }
+        }
+
+        if (!slopeCount) {
+            return 0;
+        }
+
+        std::nth_element(slopes, slopes + slopeCount / 2, slopes + slopeCount);
+        return slopes[slopeCount / 2] * 3600 * 1000;
+    }
+
+    Sample samples[capacity] = {};
+    unsigned first = 0;
+    unsigned count = 0;
+    bool wasCharging = false;
+
+    // What the battery says, smoothed over a couple of minutes
+    Ewma<120000> reported;
+    uint64_t lastReportedMs = 0;
+    bool haveReported = false;
+};
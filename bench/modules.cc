@@ -0,0 +1,184 @@
+// Runs each module and full frames against a fixture tree, e.g.
+// `bench/modules bench/fixtures/server`. Run with `make bench`.
+//
+// Only the /proc and /sys parts are redirected, so netlink and nl80211 are
+// turned off to make it use the file fallbacks, pulse isn't connected and
+// the disk probes are whatever statvfs() says about the fixture mounts.
+
+#define STATUS_BENCH
+#include "../main.cc"
+
+#include <dirent.h>
+#include <fcntl.h>
+
+#include <new>
+
+// gcc doesn't see that these match up
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+
+static size_t s_allocations = 0;
+
+void *operator new(size_t size)
+{
+    s_allocations++;
+
+    if (void *ptr = malloc(size)) {
+        return ptr;
+    }
+
+    throw std::bad_alloc();
+}
+
+void operator delete(void *ptr) noexcept
+{
+    free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept
+{
+    free(ptr);
+}
+
+static long long now_ns()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+template<typename Function>
+static void run(const char *name, int iterations, LineBuffer &out, Function &&function)
+{
+    // warm up, so the files are opened and the buffers have grown
+    for (int i = 0; i < 100; i++) {
+        function();
+        out.clear();
+    }
+
+    const size_t allocationsBefore = s_allocations;
+    const long long start = now_ns();
+
+    for (int i = 0; i < iterations; i++) {
+        function();
+        out.clear();
+    }
+
+    const long long elapsed = now_ns() - start;
+    const size_t allocations = s_allocations - allocationsBefore;
+
+    printf("%-28s %10.1f ns/frame %8.2f allocs/frame\n",
+           name, double(elapsed) / iterations, double(allocations) / iterations);
+}
+
+// Fixtures decide which interfaces we have, instead of udev
+static void find_interfaces(Status *status)
+{
+    status->udevConnection.ethernetInterfaces.clear();
+    status->udevConnection.wlanInterfaces.clear();
+
+    DIR *dir = opendir(rooted_path("/sys/class/net").c_str());
+
+    if (!dir) {
+        return;
+    }
+
+    while (dirent *entry = readdir(dir)) {
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+
+        if (strncmp(entry->d_name, "wlan", 4) == 0) {
+            status->udevConnection.wlanInterfaces.push_back(entry->d_name);
+        } else {
+            status->udevConnection.ethernetInterfaces.push_back(entry->d_name);
+        }
+    }
+
+    closedir(dir);
+
+    std::sort(status->udevConnection.ethernetInterfaces.begin(), status->udevConnection.ethernetInterfaces.end());
+    std::sort(status->udevConnection.wlanInterfaces.begin(), status->udevConnection.wlanInterfaces.end());
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s FIXTURE_DIR [ITERATIONS]\n", argv[0]);
+        return 1;
+    }
+
+    g_rootPrefix = argv[1];
+
+    while (!g_rootPrefix.empty() && g_rootPrefix.back() == '/') {
+        g_rootPrefix.pop_back();
+    }
+
+    const int iterations = argc > 2 ? std::max(atoi(argv[2]), 1) : 5000;
+
+    Status status;
+    status.rtnetlink.available = false;
+    status.nl80211.available = false;
+
+    find_interfaces(&status);
+
+    // udev doesn't go through the root prefix
+    CachedFile capacity("/sys/class/power_supply/BAT0/capacity");
+
+    if (const char *contents = capacity.read()) {
+        status.udevConnection.power.valid = true;
+        status.udevConnection.power.percentage = atoi(contents);
+    }
+
+    status.udevConnection.power.chargerOnline = false;
+
+    status.outputFd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+
+    if (status.outputFd < 0) {
+        perror("Failed to open /dev/null");
+        return 1;
+    }
+
+    status.arrangeModules("");
+    status.mountWatcher.update();
+    status.diskProber.setMounts(status.mountWatcher.mounts);
+
+    printf("%s: %zu ethernet, %zu wlan, %zu mounts, %d iterations\n", g_rootPrefix.c_str(),
+           status.udevConnection.ethernetInterfaces.size(), status.udevConnection.wlanInterfaces.size(),
+           status.mountWatcher.mounts.size(), iterations);
+
+    const uint64_t now = realtime_ms();
+
+    // Every module on its own, as if it was due every time
+    for (Module *module : status.modules) {
+        run(module->name, iterations, module->output, [&] {
+            module->run(now);
+        });
+    }
+
+    // The line is kept between frames, so don't let run() clear it
+    LineBuffer scratch;
+
+    // Normal frames, where only the ones that update every second run and
+    // the rest reuse what they had.
+    run("Status::print", iterations, scratch, [&] {
+        for (Module *module : status.modules) {
+            if (module->interval() <= 1000) {
+                module->invalidate();
+            }
+        }
+
+        status.print();
+    });
+
+    run("Status::print (everything)", iterations, scratch, [&] {
+        for (Module *module : status.modules) {
+            module->invalidate();
+        }
+
+        status.print();
+    });
+
+    close(status.outputFd);
+
+    return 0;
+}
@@ -0,0 +1,105 @@
+// Pushes a lot of notifications through the store, like something spamming
+// them would, and checks that it doesn't allocate. Run with `make bench`.
+
+#include "notificationstore.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <new>
+#include <string>
+
+static size_t s_allocations = 0;
+
+void *operator new(size_t size)
+{
+    s_allocations++;
+
+    if (void *ptr = malloc(size)) {
+        return ptr;
+    }
+
+    throw std::bad_alloc();
+}
+
+void operator delete(void *ptr) noexcept
+{
+    free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept
+{
+    free(ptr);
+}
+
+static long long now_ns()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Keeps the compiler from throwing away the results
+static volatile unsigned long long s_sink;
+
+template<typename Function>
+static void run(const char *name, int iterations, Function &&function)
+{
+    // warm up
+    for (int i = 0; i < 100; i++) {
+        function(i);
+    }
+
+    const size_t allocationsBefore = s_allocations;
+    const long long start = now_ns();
+
+    for (int i = 0; i < iterations; i++) {
+        function(i);
+    }
+
+    const long long elapsed = now_ns() - start;
+    const size_t allocations = s_allocations - allocationsBefore;
+
+    printf("%-40s %9.1f ns/notification %12.0f /s %6.2f allocs/notification\n",
+           name, double(elapsed) / iterations, iterations * 1e9 / elapsed, double(allocations) / iterations);
+}
+
+int main()
+{
+    // What 10k a second looks like, a second's worth
+    const int iterations = 10000;
+
+    const std::string shortText = "Build finished";
+    const std::string unicodeText = "Møte om fem minutter \xf0\x9f\x93\x85 - rom 4.12, \"Kaffe\" <i>og</i> kake";
+    const std::string longText(64 * 1024, 'x');
+
+    const std::string *texts[] = { &shortText, &unicodeText, &longText };
+
+    NotificationStore store;
+    LineBuffer out;
+    uint32_t lastId = 0;
+
+    run("notify + print", iterations, [&](int i) {
+        const std::string &summary = *texts[i % 3];
+
+        // Every other one updates the last one, like progress notifications
+        uint32_t dropped = 0;
+        lastId = store.notify(i % 2 ? lastId : 0, "firefox", summary, shortText, 5000, i % 4 == 0, uint64_t(i) * 100, &dropped);
+        s_sink = dropped;
+
+        out.clear();
+        print_notification(out, store.front(), uint64_t(i) * 100);
+        s_sink = s_sink + out.view().size();
+    });
+
+    run("notify + close", iterations, [&](int i) {
+        uint32_t dropped = 0;
+        const uint32_t id = store.notify(0, "chromium", *texts[i % 3], "", 5000, false, uint64_t(i) * 100, &dropped);
+        s_sink = store.close(id) + dropped;
+    });
+
+    printf("%zu notifications kept\n", store.size());
+
+    return 0;
+}
@@ -0,0 +1,196 @@
+// Measures the /proc parsers against growing inputs, and checks that they
+// don't allocate. Run with `make bench`.
+
+#include "procparsers.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <new>
+#include <string>
+
+static size_t s_allocations = 0;
+
+void *operator new(size_t size)
+{
+    s_allocations++;
+
+    if (void *ptr = malloc(size)) {
+        return ptr;
+    }
+
+    throw std::bad_alloc();
+}
+
+void operator delete(void *ptr) noexcept
+{
+    free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept
+{
+    free(ptr);
+}
+
+static long long now_ns()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Keeps the compiler from throwing away the results
+static volatile unsigned long long s_sink;
+
+template<typename Function>
+static void run(const char *name, size_t inputSize, Function &&function)
+{
+    const int iterations = 20000;
+
+    // warm up
+    for (int i = 0; i < 100; i++) {
+        function();
+    }
+
+    const size_t allocationsBefore = s_allocations;
+    const long long start = now_ns();
+
+    for (int i = 0; i < iterations; i++) {
+        function();
+    }
+
+    const long long elapsed = now_ns() - start;
+    const size_t allocations = s_allocations - allocationsBefore;
+
+    printf("%-40s %7zu bytes %9.1f ns/parse %6.2f allocs/parse\n",
+           name, inputSize, double(elapsed) / iterations, double(allocations) / iterations);
+}
+
+static std::string make_meminfo(int extraLines)
+{
+    std::string meminfo =
+        "MemTotal:       16318120 kB\n"
+        "MemFree:         4857916 kB\n"
+        "MemAvailable:   10646988 kB\n"
+        "Buffers:          383836 kB\n"
+        "Cached:          5564032 kB\n";
+
+    for (int i = 0; i < extraLines; i++) {
+        meminfo += "Extra" + std::to_string(i) + ":        12345 kB\n";
+    }
+
+    return meminfo;
+}
+
+static std::string make_net_dev(int interfaces)
+{
+    std::string netdev =
+        "Inter-|   Receive                                                |  Transmit\n"
+        " face |bytes    packets errs drop fifo frame compressed multicast|bytes    packets errs drop fifo colls carrier compressed\n"
+        "    lo: 4266634    1385    0    0    0     0          0         0  4266634    1385    0    0    0     0       0          0\n";
+
+    for (int i = 0; i < interfaces; i++) {
+        netdev += "veth" + std::to_string(i) +
+                  ": 123456789 1385 0 0 0 0 0 0 987654321 1385 0 0 0 0 0 0\n";
+    }
+
+    netdev += "  eth0: 9223372036 1385 0 0 0 0 0 0 4266634 1385 0 0 0 0 0 0\n";
+    netdev += "wlan0: 4266634 1385 0 0 0 0 0 0 4266634 1385 0 0 0 0 0 0\n";
+
+    return netdev;
+}
+
+static std::string make_diskstats(int loops)
+{
+    std::string diskstats =
+        " 259       0 nvme0n1 412231 10231 31223412 122312 891223 412231 61223312 922312 0 412331 1102312 0 0 0 0 12231 21231\n"
+        " 259       1 nvme0n1p1 1231 0 92312 312 2 0 2 0 0 412 312 0 0 0 0 0 0\n";
+
+    for (int i = 0; i < loops; i++) {
+        diskstats += "   7       " + std::to_string(i) + " loop" + std::to_string(i) +
+                     " 53 0 2123 12 0 0 0 0 0 24 12 0 0 0 0 0 0\n";
+    }
+
+    diskstats += " 253       0 dm-0 16512000 192231 1637222999 5142299 35090999 7512230 1671222999 35122299 15 14512299 51302299 0 0 0 0 0 0\n";
+
+    return diskstats;
+}
+
+int main()
+{
+    static const char stat[] =
+        "cpu  2255 34 2290 22625563 6290 127 456 0 0 0\n"
+        "cpu0 1132 34 1441 11311718 3675 127 438 0 0 0\n";
+
+    run("parse_proc_stat", sizeof stat, [] {
+        CpuTimes times;
+        parse_proc_stat(stat, &times);
+        s_sink = times.idle;
+    });
+
+    run("sscanf /proc/stat (old)", sizeof stat, [] {
+        unsigned user, nice, system, idle, iowait, irq, softirq, steal, guest, guest_nice;
+        sscanf(stat, "cpu %u %u %u %u %u %u %u %u %u %u",
+               &user, &nice, &system, &idle, &iowait,
+               &irq, &softirq, &steal, &guest, &guest_nice);
+        s_sink = idle;
+    });
+
+    for (int extraLines : { 0, 50, 1000 }) {
+        const std::string meminfo = make_meminfo(extraLines);
+        const std::string name = "parse_meminfo +" + std::to_string(extraLines) + " lines";
+
+        run(name.c_str(), meminfo.size(), [&] {
+            MemInfo info;
+            parse_meminfo(meminfo.c_str(), &info);
+            s_sink = info.available;
+        });
+    }
+
+    for (int interfaces : { 2, 64, 500 }) {
+        const std::string netdev = make_net_dev(interfaces);
+        const std::string name = "parse_net_dev " + std::to_string(interfaces) + " interfaces";
+
+        run(name.c_str(), netdev.size(), [&] {
+            int remaining = 2;
+            parse_net_dev(netdev.c_str(), [&](std::string_view device, const NetDevCounters &counters) {
+                if (device == "eth0" || device == "wlan0") {
+                    s_sink = counters.rxBytes;
+                    remaining--;
+                }
+
+                return remaining > 0;
+            });
+        });
+    }
+
+    for (int loops : { 0, 200 }) {
+        const std::string diskstats = make_diskstats(loops);
+        const std::string name = "parse_diskstats +" + std::to_string(loops) + " loops";
+
+        run(name.c_str(), diskstats.size(), [&] {
+            parse_diskstats(diskstats.c_str(), [&](std::string_view device, const DiskCounters &counters) {
+                if (device == "nvme0n1") {
+                    s_sink = counters.ioTicksMs;
+                }
+
+                return true;
+            });
+        });
+    }
+
+    // Spaces and parentheses in the name, like the kernel allows
+    static const char pidStat[] =
+        "1234 (Web Content (1)) S 1 1234 1234 0 -1 4194560 218711 0 12 0 "
+        "94251 15432 0 0 20 0 31 0 2117 3650433024 98342 18446744073709551615 "
+        "1 1 0 0 0 0 0 16781312 1082130432 0 0 0 17 3 0 0 0 0 0\n";
+
+    run("parse_pid_stat", sizeof pidStat, [] {
+        ProcessStat stat;
+        parse_pid_stat(pidStat, &stat);
+        s_sink = stat.cpuTicks + stat.rssPages;
+    });
+
+    return 0;
+}
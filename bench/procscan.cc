@@ -0,0 +1,120 @@
+// Measures the process scanner against a fake /proc with a couple of
+// thousand processes, e.g. `bench/procscan 2000`. Run with `make bench`.
+
+#include "procscan.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include <string>
+
+static long long now_ns()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static bool write_file(const std::string &path, const std::string &contents)
+{
+    FILE *file = fopen(path.c_str(), "w");
+
+    if (!file) {
+        perror(path.c_str());
+        return false;
+    }
+
+    fputs(contents.c_str(), file);
+    fclose(file);
+    return true;
+}
+
+// Every other one uses a bit of cpu and memory each time, so there's
+// something to pick between
+static bool make_proc(const std::string &root, int processes, int generation)
+{
+    for (int pid = 1; pid <= processes; pid++) {
+        const std::string dir = root + "/proc/" + std::to_string(pid);
+
+        if (generation == 0 && mkdir(dir.c_str(), 0755) < 0) {
+            perror(dir.c_str());
+            return false;
+        }
+
+        const unsigned long long ticks = 1000 + (pid % 2) * generation * pid;
+        const unsigned long long rss = 2000 + (pid % 2) * generation * pid;
+
+        const std::string stat = std::to_string(pid) + " (process " + std::to_string(pid) + ") S 1 1 1 0 -1 4194560 "
+                                 "218711 0 12 0 " + std::to_string(ticks) + " 0 0 0 20 0 1 0 2117 3650433024 " +
+                                 std::to_string(rss) + " 18446744073709551615 1 1 0 0 0 0 0 0 0 0 0 0 17 3 0 0 0 0 0\n";
+
+        if (!write_file(dir + "/stat", stat)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    const int processes = argc > 1 ? atoi(argv[1]) : 2000;
+    const int iterations = 50;
+
+    char root[] = "/tmp/procscan-XXXXXX";
+
+    if (!mkdtemp(root) || mkdir((std::string(root) + "/proc").c_str(), 0755) < 0) {
+        perror("Failed to create fake /proc");
+        return 1;
+    }
+
+    g_rootPrefix = root;
+
+    if (!make_proc(root, processes, 0)) {
+        return 1;
+    }
+
+    ProcessScanner scanner;
+    scanner.fullScanIntervalMs = 1;
+
+    long long fullNs = 0;
+    uint64_t nowMs = 1;
+
+    for (int i = 0; i < iterations; i++) {
+        const long long start = now_ns();
+        scanner.update(nowMs++);
+        fullNs += now_ns() - start;
+    }
+
+    // Something to compare with, so it picks the top ones
+    make_proc(root, processes, 1);
+    scanner.update(nowMs++);
+
+    scanner.fullScanIntervalMs = 30000;
+
+    long long refreshNs = 0;
+
+    for (int i = 0; i < iterations; i++) {
+        const long long start = now_ns();
+        scanner.update(++nowMs);
+        refreshNs += now_ns() - start;
+    }
+
+    // Only the odd ones kept growing
+    make_proc(root, processes, 3);
+    const TopProcess cpu = scanner.top(ProcessScanner::Cpu, ++nowMs);
+    const TopProcess memory = scanner.top(ProcessScanner::Memory, nowMs);
+
+    printf("%d processes (%zu found), top cpu '%s', top memory '%s'\n", processes, scanner.processCount(), cpu.name, memory.name);
+    printf("%-40s %9.1f us\n", "full scan", fullNs / 1000.0 / iterations);
+    printf("%-40s %9.1f us\n", "refresh of the top ones", refreshNs / 1000.0 / iterations);
+
+    // Full scan every 30 seconds and a refresh every second in between
+    const double perSecondUs = (fullNs / 1000.0 / iterations + 29 * refreshNs / 1000.0 / iterations) / 30;
+    printf("%-40s %9.1f us\n", "per second while alerting", perSecondUs);
+
+    const std::string cleanup = std::string("rm -rf ") + root;
+    return system(cleanup.c_str()) == 0 ? 0 : 1;
+}
@@ -0,0 +1,112 @@
+// Records a few frames with a notification showing, replays them with
+// nothing in the store and checks that the output is the same. Run with
+// `make bench`.
+
+#define STATUS_BENCH
+#define ENABLE_NOTIFICATIONS
+#include "../main.cc"
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <iterator>
+#include <string>
+
+static const int frames = 20;
+
+// Like the main loop, a frame is the time, then whatever is due
+static void run_frame(Module **modules, size_t count, uint64_t nowMs, std::string *output)
+{
+    g_recorder.beginFrame();
+
+    const uint64_t now = g_recorder.capture("time", "frame", [&] { return nowMs; });
+
+    for (size_t i = 0; i < count; i++) {
+        modules[i]->run(now);
+        output->append(modules[i]->output.view());
+        output->append("\n");
+    }
+
+    g_recorder.endFrame();
+}
+
+int main()
+{
+    char path[] = "/tmp/status-replay-XXXXXX";
+    const int fd = mkstemp(path);
+
+    if (fd < 0) {
+        perror("Failed to create recording");
+        return 1;
+    }
+
+    close(fd);
+
+    if (!g_recorder.startRecording(path)) {
+        unlink(path);
+        return 1;
+    }
+
+    const uint64_t start = realtime_ms() / 1000 * 1000;
+    std::string recorded;
+
+    {
+        NotificationModule notification;
+        ClockModule clock;
+        Module *modules[] = { &notification, &clock };
+
+        // Goes away half way through, so both showing and not are covered
+        uint32_t dropped;
+        g_notifications.notify(0, "mail", "New message from Alice", "Lunch", 0, true, start, &dropped);
+
+        for (int i = 0; i < frames; i++) {
+            const uint64_t now = start + i * 1000;
+
+            while (!g_notifications.empty() && g_notifications.front().expiresMs <= now) {
+                g_notifications.popFront();
+            }
+
+            run_frame(modules, std::size(modules), now, &recorded);
+        }
+    }
+
+    // Anything still in the store would hide that it wasn't replayed
+    g_notifications = NotificationStore();
+
+    if (!g_recorder.startReplay(path)) {
+        unlink(path);
+        return 1;
+    }
+
+    unlink(path);
+
+    std::string replayed;
+    int replayedFrames = 0;
+
+    {
+        NotificationModule notification;
+        ClockModule clock;
+        Module *modules[] = { &notification, &clock };
+
+        int64_t timestamp;
+
+        while (g_recorder.nextFrame(&timestamp)) {
+            run_frame(modules, std::size(modules), 0, &replayed);
+            replayedFrames++;
+        }
+    }
+
+    if (replayedFrames != frames || replayed != recorded) {
+        fprintf(stderr, "replay: %d of %d frames, output differs:\n--- recorded\n%s--- replayed\n%s",
+                replayedFrames, frames, recorded.c_str(), replayed.c_str());
+        return 1;
+    }
+
+    if (recorded.find("New message from Alice") == std::string::npos) {
+        fprintf(stderr, "replay: the notification was never shown\n");
+        return 1;
+    }
+
+    printf("replay: %d frames with a notification came out the same\n", frames);
+    return 0;
+}
@@ -0,0 +1,102 @@
+#pragma once
+
+#include "filecache.h"
+
+#include <dirent.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+// Finds the physical disks behind a block device in /sys/block terms, so
+// e. g. IO on /home on LUKS on LVM on nvme0n1p3 shows up as nvme0n1.
+// Partitions go to the disk they're on, device mapper and md to what
+// they're built from (the slaves), and loop devices to whatever disk their
+// backing file is on.
+inline void find_physical_disks(dev_t device, std::vector<std::string> *disks, int depth = 0);
+
+inline void find_physical_disks(const std::string &sysPath, std::vector<std::string> *disks, int depth)
+{
+    // Loops of loops, or something is very broken
+    if (depth > 8) {
+        return;
+    }
+
+    char resolved[PATH_MAX];
+
+    if (!realpath(sysPath.c_str(), resolved)) {
+        return;
+    }
+
+    const std::string path = resolved;
+
+    if (access((path + "/partition").c_str(), F_OK) == 0) {
+        find_physical_disks(path.substr(0, path.rfind('/')), disks, depth + 1);
+        return;
+    }
+
+    if (DIR *slaves = opendir((path + "/slaves").c_str())) {
+        bool found = false;
+
+        while (const dirent *entry = readdir(slaves)) {
+            if (entry->d_name[0] != '.') {
+                find_physical_disks(path + "/slaves/" + entry->d_name, disks, depth + 1);
+                found = true;
+            }
+        }
+
+        closedir(slaves);
+
+        if (found) {
+            return;
+        }
+    }
+
+    if (FILE *file = fopen((path + "/loop/backing_file").c_str(), "r")) {
+        char backing[PATH_MAX] = {};
+        const bool haveBacking = fgets(backing, sizeof backing, file);
+        fclose(file);
+
+        backing[strcspn(backing, "\n")] = '\0';
+        struct stat info;
+
+        if (haveBacking && stat(rooted_path(backing).c_str(), &info) == 0) {
+            find_physical_disks(info.st_dev, disks, depth + 1);
+        }
+
+        return;
+    }
+
+    const std::string name = path.substr(path.rfind('/') + 1);
+
+    if (std::find(disks->begin(), disks->end(), name) == disks->end()) {
+        disks->push_back(name);
+    }
+}
+
+inline void find_physical_disks(dev_t device, std::vector<std::string> *disks, int depth)
+{
+    char sysPath[64];
+    snprintf(sysPath, sizeof sysPath, "/sys/dev/block/%u:%u", major(device), minor(device));
+    find_physical_disks(rooted_path(sysPath), disks, depth);
+}
+
+// For filesystems like btrfs, where the device in the mount table isn't a
+// real block device, go by what was mounted instead.
+inline dev_t mount_source_device(const std::string &source)
+{
+    struct stat info;
+
+    if (source.compare(0, 5, "/dev/") != 0 || stat(rooted_path(source).c_str(), &info) != 0 || !S_ISBLK(info.st_mode)) {
+        return 0;
+    }
+
+    return info.st_rdev;
+}
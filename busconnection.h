@@ -0,0 +1,135 @@
+#pragma once
+
+#include <limits.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <time.h>
+
+#include <algorithm>
+
+#include <systemd/sd-bus.h>
+
+// A bus connection that's kept for as long as we're running, with its fd in
+// the event loop. Calls don't wait for the reply (or for the connection to
+// be set up), so a slow or hung service can't hold up a frame.
+struct BusConnection {
+    BusConnection() = default;
+
+    BusConnection(const BusConnection &) = delete;
+    BusConnection &operator=(const BusConnection &) = delete;
+
+    ~BusConnection()
+    {
+        // Gets out anything still queued, like a poweroff
+        if (bus) {
+            sd_bus_flush_close_unref(bus);
+        }
+    }
+
+    bool open(bool system)
+    {
+        const int ret = system ? sd_bus_open_system(&bus) : sd_bus_open_user(&bus);
+
+        if (ret < 0 || !bus) {
+            fprintf(stderr, "Failed to connect to %s bus: %s\n", system ? "system" : "user", strerror(-ret));
+            bus = nullptr;
+            return false;
+        }
+
+        fd = sd_bus_get_fd(bus);
+        return fd >= 0;
+    }
+
+    // Call when the fd is ready, dispatches everything that has come in
+    void process()
+    {
+        int ret = 0;
+
+        do {
+            ret = sd_bus_process(bus, nullptr);
+        } while (ret > 0);
+
+        if (ret < 0) {
+            fprintf(stderr, "Failed to process bus: %s\n", strerror(-ret));
+        }
+    }
+
+    // What to wait for in epoll, it only wants to write while something is
+    // queued (like while still connecting)
+    uint32_t events() const
+    {
+        const int events = bus ? sd_bus_get_events(bus) : 0;
+
+        if (events < 0) {
+            return 0;
+        }
+
+        return (events & POLLIN ? uint32_t(EPOLLIN) : 0) | (events & POLLOUT ? uint32_t(EPOLLOUT) : 0);
+    }
+
+    // When it needs to be processed even if nothing comes in, like for a
+    // call that wasn't answered in time, in ms from now. -1 for never.
+    int timeoutMs() const
+    {
+        uint64_t timeoutUs = 0;
+
+        if (!bus || sd_bus_get_timeout(bus, &timeoutUs) < 0 || timeoutUs == UINT64_MAX) {
+            return -1;
+        }
+
+        // It's in CLOCK_MONOTONIC
+        timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        const uint64_t nowUs = uint64_t(now.tv_sec) * 1000000 + now.tv_nsec / 1000;
+
+        if (timeoutUs <= nowUs) {
+            return 0;
+        }
+
+        // A millisecond extra so it's really expired when we wake up
+        return int(std::min<uint64_t>((timeoutUs - nowUs) / 1000 + 1, INT_MAX));
+    }
+
+    // Fire and forget, errors in the reply are just printed with what
+    template<typename ...Args>
+    bool call(const char *what, const char *destination, const char *path, const char *interface, const char *member,
+              const char *signature, Args ...args)
+    {
+        if (!bus) {
+            fprintf(stderr, "Not connected, can't %s\n", what);
+            return false;
+        }
+
+        // No slot, so it belongs to the bus and goes away with the reply
+        const int ret = sd_bus_call_method_async(bus, nullptr, destination, path, interface, member,
+                                                 on_reply, const_cast<char *>(what), signature, args...);
+
+        if (ret < 0) {
+            fprintf(stderr, "Failed to %s: %s\n", what, strerror(-ret));
+            return false;
+        }
+
+        return true;
+    }
+
+    sd_bus *bus = nullptr;
+    int fd = -1;
+
+    // What the event loop is waiting for now
+    uint32_t watching = 0;
+
+private:
+    static int on_reply(sd_bus_message *reply, void *userdata, sd_bus_error * /*error*/)
+    {
+        const sd_bus_error *error = sd_bus_message_get_error(reply);
+
+        if (error) {
+            fprintf(stderr, "Failed to %s: %s\n", static_cast<const char *>(userdata), error->message);
+        }
+
+        return 0;
+    }
+};
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/prctl.h>
+
+// Decides how much slower than their configured interval the modules that
+// just sample something (cpu, net, ...) should run. Slower on battery and
+// when nothing is happening, and back to normal for a while as soon as one
+// of them sees something moving.
+struct Cadence {
+    // Returns what to multiply the intervals with
+    unsigned update(uint64_t nowMs, bool onBattery, bool busy)
+    {
+        if (!enabled) {
+            return 1;
+        }
+
+        // Start out at the normal rate, and start over if the wall clock was
+        // set back
+        if (busy || !lastBusyMs || nowMs < lastBusyMs) {
+            lastBusyMs = nowMs;
+        }
+
+        const uint64_t quietMs = nowMs - lastBusyMs;
+
+        if (quietMs < boostMs) {
+            return 1;
+        }
+
+        unsigned factor = onBattery ? batteryFactor : 1;
+
+        if (quietMs >= idleAfterMs) {
+            factor *= idleFactor;
+        }
+
+        return factor;
+    }
+
+    bool enabled = true;
+
+    unsigned batteryFactor = 2;
+    unsigned idleFactor = 2;
+
+    // How long to stay at the normal rate after something was busy, and how
+    // long it has to be quiet before we count it as idle
+    uint64_t boostMs = 30000;
+    uint64_t idleAfterMs = 60000;
+
+    uint64_t lastBusyMs = 0;
+};
+
+// Lets the kernel fire our timers up to this late, so it can wake us up
+// together with something else instead of just for us. Threads get it from
+// whoever creates them, so do it before starting any.
+inline void set_timer_slack(unsigned long ns)
+{
+    if (prctl(PR_SET_TIMERSLACK, ns, 0, 0, 0) < 0) {
+        fprintf(stderr, "Failed to set timer slack: %s\n", strerror(errno));
+    }
+}
@@ -0,0 +1,262 @@
+#pragma once
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <string_view>
+
+// i3bar mouse buttons
+enum MouseButton {
+    ButtonLeft = 1,
+    ButtonMiddle = 2,
+    ButtonRight = 3,
+    ScrollUp = 4,
+    ScrollDown = 5,
+};
+
+// One click from i3bar, the strings point into the reader's buffer so
+// they're only good until the next read.
+struct ClickEvent {
+    std::string_view name;
+    std::string_view instance;
+    int button = 0;
+};
+
+// pos is right after the opening quote, returns what comes after the closing
+// one, or nullptr if it doesn't end. Unescapes in place, which works because
+// it only gets shorter.
+inline char *parse_json_string(char *pos, std::string_view *result)
+{
+    char *const start = pos;
+    char *out = pos;
+
+    while (*pos && *pos != '"') {
+        if (*pos != '\\') {
+            *out++ = *pos++;
+            continue;
+        }
+
+        pos++;
+
+        switch (*pos) {
+        case 'n':
+            *out++ = '\n';
+            break;
+
+        case 't':
+            *out++ = '\t';
+            break;
+
+        case 'u': {
+            // We only escape control characters like this ourselves, so
+            // anything outside ASCII isn't something we need to match
+            char hex[5] = {};
+
+            for (int i = 0; i < 4; i++) {
+                if (!isxdigit(static_cast<unsigned char>(pos[1 + i]))) {
+                    return nullptr;
+                }
+
+                hex[i] = pos[1 + i];
+            }
+
+            const long codepoint = strtol(hex, nullptr, 16);
+            *out++ = codepoint < 0x80 ? char(codepoint) : '?';
+            pos += 4;
+            break;
+        }
+
+        case '\0':
+            return nullptr;
+
+        default:
+            // \" \\ \/ and the ones we don't care about
+            *out++ = *pos;
+            break;
+        }
+
+        pos++;
+    }
+
+    if (*pos != '"') {
+        return nullptr;
+    }
+
+    *result = std::string_view(start, out - start);
+    return pos + 1;
+}
+
+inline char *skip_json_space(char *pos)
+{
+    while (*pos == ' ' || *pos == '\t' || *pos == '\r' || *pos == '\n') {
+        pos++;
+    }
+
+    return pos;
+}
+
+// Skips over anything we don't need, like the modifiers array, and stops at
+// the comma or brace after it.
+inline char *skip_json_value(char *pos)
+{
+    int depth = 0;
+
+    while (*pos) {
+        switch (*pos) {
+        case '"': {
+            std::string_view ignored;
+            pos = parse_json_string(pos + 1, &ignored);
+
+            if (!pos) {
+                return nullptr;
+            }
+
+            continue;
+        }
+
+        case '[':
+        case '{':
+            depth++;
+            break;
+
+        case ']':
+        case '}':
+            if (depth == 0) {
+                return pos;
+            }
+
+            depth--;
+            break;
+
+        case ',':
+            if (depth == 0) {
+                return pos;
+            }
+
+            break;
+        }
+
+        pos++;
+    }
+
+    return nullptr;
+}
+
+// One line from i3bar, like
+// {"name":"volume","instance":"","button":1,"modifiers":[],"x":1800,...}
+// possibly with a comma in front, since it's one long array.
+inline bool parse_click_event(char *line, ClickEvent *event)
+{
+    char *pos = strchr(line, '{');
+
+    if (!pos) {
+        return false;
+    }
+
+    pos = skip_json_space(pos + 1);
+
+    while (*pos == '"') {
+        std::string_view key;
+        pos = parse_json_string(pos + 1, &key);
+
+        if (!pos) {
+            return false;
+        }
+
+        pos = skip_json_space(pos);
+
+        if (*pos != ':') {
+            return false;
+        }
+
+        pos = skip_json_space(pos + 1);
+
+        if (key == "name" || key == "instance") {
+            if (*pos != '"') {
+                return false;
+            }
+
+            pos = parse_json_string(pos + 1, key == "name" ? &event->name : &event->instance);
+        } else if (key == "button") {
+            char *end = nullptr;
+            event->button = strtol(pos, &end, 10);
+            pos = end == pos ? nullptr : end;
+        } else {
+            pos = skip_json_value(pos);
+        }
+
+        if (!pos) {
+            return false;
+        }
+
+        pos = skip_json_space(pos);
+
+        if (*pos == ',') {
+            pos = skip_json_space(pos + 1);
+        }
+    }
+
+    return *pos == '}' && event->button;
+}
+
+// Reads the click events i3bar writes to our stdin when we tell it we want
+// them. Only reads once per call, so it can be called whenever epoll says
+// there's something without ever blocking.
+struct ClickReader {
+    // Calls handler for each complete event, returns false when i3bar is
+    // gone and there won't be any more.
+    template<typename Handler>
+    bool read(int fd, Handler &&handler)
+    {
+        const ssize_t ret = ::read(fd, buffer + length, sizeof buffer - 1 - length);
+
+        if (ret < 0) {
+            if (errno == EINTR || errno == EAGAIN) {
+                return true;
+            }
+
+            fprintf(stderr, "Failed to read click events: %s\n", strerror(errno));
+            return false;
+        }
+
+        if (ret == 0) {
+            return false;
+        }
+
+        length += ret;
+        buffer[length] = '\0';
+
+        char *line = buffer;
+
+        while (char *end = static_cast<char *>(memchr(line, '\n', buffer + length - line))) {
+            *end = '\0';
+
+            ClickEvent event;
+
+            if (parse_click_event(line, &event)) {
+                handler(event);
+            }
+
+            line = end + 1;
+        }
+
+        // Keep the start of the next one for later
+        length = buffer + length - line;
+        memmove(buffer, line, length);
+
+        // Not anything we understand if it's this long
+        if (length == sizeof buffer - 1) {
+            length = 0;
+        }
+
+        return true;
+    }
+
+private:
+    char buffer[4096];
+    size_t length = 0;
+};
@@ -0,0 +1,260 @@
+#pragma once
+
+#include "mounts.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/statvfs.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct DiskUsage {
+    bool valid = false; // have we ever gotten a result
+    bool stale = false; // the current probe is taking too long
+    bool pending = false; // the first probe hasn't finished yet
+    double gbFree = 0;
+};
+
+// statvfs() on a hung network or FUSE mount, or a dying disk, can block
+// forever, so it's done by a few worker threads taking the mounts from a
+// queue. A mount that hangs only ties up the worker that got it, and the bar
+// just shows the last value we got as stale. When a probe is past its
+// deadline that worker is replaced, but only up to a point, so a lot of hung
+// mounts can't make us start threads without end.
+struct DiskProber {
+    using Clock = std::chrono::steady_clock;
+
+    ~DiskProber()
+    {
+        if (!shared) {
+            return;
+        }
+
+        // The workers have their own reference, and the stuck ones exit
+        // whenever statvfs() returns
+        std::lock_guard<std::mutex> lock(shared->mutex);
+        shared->stopping = true;
+        shared->wakeup.notify_all();
+    }
+
+    // Starts probing new mounts and stops the ones that are gone
+    void setMounts(const std::vector<Mount> &mounts)
+    {
+        if (!shared) {
+            start();
+        }
+
+        std::vector<std::shared_ptr<Probe>> newProbes;
+        std::vector<std::shared_ptr<Probe>> started;
+        std::lock_guard<std::mutex> lock(shared->mutex);
+
+        for (const Mount &mount : mounts) {
+            std::shared_ptr<Probe> probe;
+
+            for (std::shared_ptr<Probe> &existing : probes) {
+                if (existing && existing->path == mount.path) {
+                    probe = std::move(existing);
+                    break;
+                }
+            }
+
+            if (!probe) {
+                probe = std::make_shared<Probe>();
+                probe->path = mount.path;
+                started.push_back(probe);
+            }
+
+            newProbes.push_back(std::move(probe));
+        }
+
+        // New ones first, they have nothing to show yet
+        shared->queue.insert(shared->queue.begin(), started.begin(), started.end());
+        shared->wakeup.notify_all();
+
+        // Dropped from the queue when they come up
+        for (const std::shared_ptr<Probe> &probe : probes) {
+            if (probe) {
+                probe->removed = true;
+            }
+        }
+
+        probes = std::move(newProbes);
+    }
+
+    DiskUsage get(const std::string &path)
+    {
+        DiskUsage usage;
+
+        if (!shared) {
+            return usage;
+        }
+
+        std::lock_guard<std::mutex> lock(shared->mutex);
+
+        for (const std::shared_ptr<Probe> &probe : probes) {
+            if (probe->path != path) {
+                continue;
+            }
+
+            usage.valid = probe->haveResult;
+            usage.gbFree = probe->gbFree;
+            usage.stale = probe->probing && Clock::now() - probe->probeStarted > deadline;
+            usage.pending = !probe->probed && !usage.stale;
+
+            if (usage.stale && !probe->stuck) {
+                replaceStuckWorker(probe.get());
+            }
+
+            break;
+        }
+
+        return usage;
+    }
+
+    std::chrono::seconds interval{10};
+    std::chrono::seconds deadline{2};
+
+    static constexpr unsigned workerCount = 3;
+
+    // Hung mounts we'll give up a thread for before we stop replacing them
+    static constexpr unsigned maxStuckWorkers = 8;
+
+private:
+    // Only touched with the shared mutex held
+    struct Probe {
+        std::string path;
+        bool removed = false;
+
+        Clock::time_point due;
+        bool probing = false;
+        bool stuck = false; // and its worker has been replaced
+        Clock::time_point probeStarted;
+
+        bool probed = false;
+        bool haveResult = false;
+        double gbFree = 0;
+    };
+
+    // Outlives us if a worker is stuck
+    struct Shared {
+        std::mutex mutex;
+        std::condition_variable wakeup;
+        bool stopping = false;
+
+        // Due first, they all have the same interval so it stays sorted
+        std::deque<std::shared_ptr<Probe>> queue;
+        std::chrono::seconds interval;
+
+        unsigned workers = 0;
+        unsigned stuckWorkers = 0;
+    };
+
+    void start()
+    {
+        shared = std::make_shared<Shared>();
+        shared->interval = interval;
+
+        std::lock_guard<std::mutex> lock(shared->mutex);
+
+        for (unsigned i = 0; i < workerCount; i++) {
+            spawnWorker();
+        }
+    }
+
+    void replaceStuckWorker(Probe *probe)
+    {
+        if (shared->stuckWorkers >= maxStuckWorkers) {
+            return;
+        }
+
+        probe->stuck = true;
+        shared->stuckWorkers++;
+        spawnWorker();
+    }
+
+    // With the mutex held. Detached, because if it's stuck in statvfs()
+    // there's nothing we can do about it anyways.
+    void spawnWorker()
+    {
+        shared->workers++;
+        std::thread(run, shared).detach();
+    }
+
+    static void run(std::shared_ptr<Shared> shared)
+    {
+        std::unique_lock<std::mutex> lock(shared->mutex);
+
+        while (!shared->stopping) {
+            if (shared->queue.empty()) {
+                shared->wakeup.wait(lock);
+                continue;
+            }
+
+            std::shared_ptr<Probe> probe = shared->queue.front();
+
+            if (probe->removed) {
+                shared->queue.pop_front();
+                continue;
+            }
+
+            if (probe->due > Clock::now()) {
+                shared->wakeup.wait_until(lock, probe->due);
+                continue;
+            }
+
+            shared->queue.pop_front();
+            probe->probing = true;
+            probe->probeStarted = Clock::now();
+            lock.unlock();
+
+            struct statvfs buf;
+            const bool ok = statvfs(probe->path.c_str(), &buf) == 0;
+
+            if (!ok) {
+                fprintf(stderr, "error running statvfs on %s: %s\n", probe->path.c_str(), strerror(errno));
+            }
+
+            lock.lock();
+            probe->probing = false;
+            probe->probed = true;
+
+            // If it fails it's most likely gone, so stop showing it
+            probe->haveResult = ok;
+
+            if (ok) {
+                probe->gbFree = double(buf.f_bavail) * double(buf.f_bsize) / 1000000000.0;
+            }
+
+            probe->due = Clock::now() + shared->interval;
+
+            if (!probe->removed) {
+                shared->queue.push_back(probe);
+            }
+
+            // Someone else took over while we were stuck
+            if (probe->stuck) {
+                probe->stuck = false;
+                shared->stuckWorkers--;
+
+                if (shared->workers > workerCount) {
+                    // In case the others are waiting for an empty queue
+                    shared->wakeup.notify_one();
+                    break;
+                }
+            }
+        }
+
+        shared->workers--;
+    }
+
+    std::shared_ptr<Shared> shared;
+    std::vector<std::shared_ptr<Probe>> probes;
+};
@@ -0,0 +1,258 @@
+#pragma once
+
+#include "stats.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <functional>
+#include <unordered_map>
+
+// Waits on all our file descriptors with epoll, and ticks on a timerfd that
+// is armed with an absolute time so it fires just after each wall clock
+// second instead of drifting. Or, with scheduleTick(), just after whatever
+// wall clock time we need to wake up at next.
+struct EventLoop {
+    using Handler = std::function<void(uint32_t events)>;
+
+    struct TimerStats {
+        uint64_t ticks = 0;
+        uint64_t missed = 0;
+        int64_t totalJitterNs = 0;
+        int64_t maxJitterNs = 0;
+        int64_t lastJitterNs = 0;
+    };
+
+    EventLoop()
+    {
+        epollFd = epoll_create1(EPOLL_CLOEXEC);
+
+        if (epollFd < 0) {
+            fprintf(stderr, "Failed to create epoll fd: %s\n", strerror(errno));
+            return;
+        }
+
+        timerFd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+
+        if (timerFd < 0) {
+            fprintf(stderr, "Failed to create timerfd: %s\n", strerror(errno));
+            return;
+        }
+
+        epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.fd = timerFd;
+
+        if (epoll_ctl(epollFd, EPOLL_CTL_ADD, timerFd, &event) < 0) {
+            fprintf(stderr, "Failed to add timerfd to epoll: %s\n", strerror(errno));
+            return;
+        }
+
+        valid = armTimer();
+    }
+
+    ~EventLoop()
+    {
+        if (timerFd >= 0) {
+            close(timerFd);
+        }
+
+        if (epollFd >= 0) {
+            close(epollFd);
+        }
+    }
+
+    EventLoop(const EventLoop &) = delete;
+    EventLoop &operator=(const EventLoop &) = delete;
+
+    bool add(int fd, uint32_t events, Handler handler)
+    {
+        if (fd < 0) {
+            return false;
+        }
+
+        epoll_event event = {};
+        event.events = events;
+        event.data.fd = fd;
+
+        if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) < 0) {
+            fprintf(stderr, "Failed to add fd %d to epoll: %s\n", fd, strerror(errno));
+            return false;
+        }
+
+        handlers[fd] = std::move(handler);
+        return true;
+    }
+
+    bool modify(int fd, uint32_t events)
+    {
+        epoll_event event = {};
+        event.events = events;
+        event.data.fd = fd;
+
+        if (epoll_ctl(epollFd, EPOLL_CTL_MOD, fd, &event) < 0) {
+            fprintf(stderr, "Failed to modify fd %d in epoll: %s\n", fd, strerror(errno));
+            return false;
+        }
+
+        return true;
+    }
+
+    void remove(int fd)
+    {
+        if (handlers.erase(fd)) {
+            epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+        }
+    }
+
+    // Switches the timer from every second to firing once, at the given wall
+    // clock time in milliseconds. Only touches the timer if that changed.
+    bool scheduleTick(uint64_t realtimeMs)
+    {
+        const int64_t expiryNs = int64_t(realtimeMs) * 1000000LL + timerOffsetNs;
+
+        if (!periodic && expiryNs == nextExpiryNs) {
+            return true;
+        }
+
+        itimerspec spec = {};
+        spec.it_value.tv_sec = expiryNs / 1000000000LL;
+        spec.it_value.tv_nsec = expiryNs % 1000000000LL;
+
+        if (timerfd_settime(timerFd, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET, &spec, nullptr) < 0) {
+            fprintf(stderr, "Failed to schedule timer: %s\n", strerror(errno));
+            return false;
+        }
+
+        periodic = false;
+        nextExpiryNs = expiryNs;
+        return true;
+    }
+
+    // Waits until either the timer fires, the timeout runs out or something
+    // happens on one of our fds, and calls the handlers. Returns false on
+    // errors we can't recover from, ticked is set if the timer fired or we
+    // timed out. The timeout is subject to the timer slack, unlike the timer.
+    bool wait(bool *ticked, int timeoutMs = -1)
+    {
+        *ticked = false;
+
+        epoll_event events[16];
+        g_stats.countWakeup();
+        const int count = epoll_wait(epollFd, events, 16, timeoutMs);
+
+        if (count < 0) {
+            if (errno == EINTR) {
+                return true;
+            }
+
+            fprintf(stderr, "epoll_wait failed: %s\n", strerror(errno));
+            return false;
+        }
+
+        if (count == 0) {
+            *ticked = true;
+            return true;
+        }
+
+        for (int i = 0; i < count; i++) {
+            const int fd = events[i].data.fd;
+
+            if (fd == timerFd) {
+                *ticked = readTimer() || *ticked;
+                continue;
+            }
+
+            // Might have been removed by an earlier handler
+            auto it = handlers.find(fd);
+
+            if (it != handlers.end()) {
+                it->second(events[i].events);
+            }
+        }
+
+        return true;
+    }
+
+    bool valid = false;
+    TimerStats timerStats;
+
+private:
+    static int64_t to_ns(const timespec &ts)
+    {
+        return int64_t(ts.tv_sec) * 1000000000LL + ts.tv_nsec;
+    }
+
+    // Fire slightly after the second changes, so the clock shows the new one
+    static constexpr long timerOffsetNs = 1000000;
+
+    bool armTimer()
+    {
+        timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+
+        itimerspec spec = {};
+        spec.it_value.tv_sec = now.tv_sec + 1;
+        spec.it_value.tv_nsec = timerOffsetNs;
+        spec.it_interval.tv_sec = 1;
+
+        // Get told when someone sets the clock, so we can realign
+        if (timerfd_settime(timerFd, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET, &spec, nullptr) < 0) {
+            fprintf(stderr, "Failed to arm timer: %s\n", strerror(errno));
+            return false;
+        }
+
+        nextExpiryNs = to_ns(spec.it_value);
+        periodic = true;
+        return true;
+    }
+
+    bool readTimer()
+    {
+        uint64_t expirations = 0;
+
+        if (read(timerFd, &expirations, sizeof expirations) != sizeof expirations) {
+            if (errno == ECANCELED) {
+                // Clock was changed, start over on the new second boundaries
+                armTimer();
+                return true;
+            }
+
+            return false;
+        }
+
+        timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+
+        // How late we were to the last expiry
+        const int64_t lastExpiryNs = nextExpiryNs + int64_t(expirations - 1) * 1000000000LL;
+        const int64_t jitter = to_ns(now) - lastExpiryNs;
+
+        if (periodic) {
+            nextExpiryNs = lastExpiryNs + 1000000000LL;
+        }
+
+        timerStats.ticks++;
+        g_stats.timerTicks++;
+        timerStats.missed += expirations - 1;
+        timerStats.lastJitterNs = jitter;
+        timerStats.totalJitterNs += jitter;
+        timerStats.maxJitterNs = std::max(timerStats.maxJitterNs, jitter);
+
+        return true;
+    }
+
+    int epollFd = -1;
+    int timerFd = -1;
+    int64_t nextExpiryNs = 0;
+    bool periodic = true;
+
+    std::unordered_map<int, Handler> handlers;
+};
@@ -0,0 +1,144 @@
+#pragma once
+
+#include "recorder.h"
+#include "stats.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <string>
+#include <utility>
+#include <vector>
+
+// Prepended to every /proc and /sys path we open, so everything can be
+// pointed at a fixture tree instead of the real thing. Empty normally, and
+// needs to be set before anything opens files.
+inline std::string g_rootPrefix;
+
+inline std::string rooted_path(const std::string &path)
+{
+    return g_rootPrefix + path;
+}
+
+// Keeps a file in /proc or /sys open and re-reads it from the start with
+// pread(), instead of opening and closing it every second.
+struct CachedFile {
+    CachedFile() = default;
+
+    explicit CachedFile(std::string filePath) :
+        path(std::move(filePath))
+    {}
+
+    CachedFile(const CachedFile &) = delete;
+    CachedFile &operator=(const CachedFile &) = delete;
+
+    CachedFile(CachedFile &&other) :
+        path(std::move(other.path)),
+        buffer(std::move(other.buffer)),
+        length(other.length),
+        fd(std::exchange(other.fd, -1))
+    {}
+
+    ~CachedFile()
+    {
+        close();
+    }
+
+    // Returns the contents as a NUL terminated string, or nullptr (with errno
+    // set) if it couldn't be read. The buffer is only valid until the next
+    // call.
+    const char *read()
+    {
+        if (g_recorder.replaying()) {
+            return g_recorder.replayFile(path, &length);
+        }
+
+        const char *contents = readFile();
+        g_recorder.recordFile(path, contents, length, errno);
+        return contents;
+    }
+
+    size_t size() const
+    {
+        return length;
+    }
+
+    bool isOpen() const
+    {
+        return fd >= 0;
+    }
+
+    void close()
+    {
+        if (fd >= 0) {
+            ::close(fd);
+            fd = -1;
+        }
+    }
+
+    std::string path;
+
+private:
+    static constexpr size_t initialSize = 4096;
+
+    const char *readFile()
+    {
+        if (fd < 0 && !open()) {
+            return nullptr;
+        }
+
+        if (buffer.empty()) {
+            buffer.resize(initialSize);
+        }
+
+        bool reopened = false;
+
+        while (true) {
+            g_stats.reads++;
+            const ssize_t ret = pread(fd, buffer.data(), buffer.size() - 1, 0);
+
+            if (ret < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+
+                // The device went away (and maybe came back), try once to get
+                // a fresh handle.
+                if ((errno == ENODEV || errno == ESTALE) && !reopened) {
+                    reopened = true;
+                    close();
+
+                    if (open()) {
+                        continue;
+                    }
+                }
+
+                return nullptr;
+            }
+
+            // Filled the entire buffer, so there might be more; grow and read
+            // everything again. Only happens until we've found the size.
+            if (size_t(ret) == buffer.size() - 1) {
+                buffer.resize(buffer.size() * 2);
+                continue;
+            }
+
+            length = ret;
+            buffer[length] = '\0';
+            return buffer.data();
+        }
+    }
+
+    bool open()
+    {
+        fd = ::open(rooted_path(path).c_str(), O_RDONLY | O_CLOEXEC);
+        return fd >= 0;
+    }
+
+    std::vector<char> buffer;
+    size_t length = 0;
+    int fd = -1;
+};
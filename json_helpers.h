@@ -1,51 +1,209 @@
 #pragma once
 
+#include "stats.h"
+
+#include <errno.h>
+#include <stdarg.h>
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string_view>
+#include <vector>
+
+// Everything for one status line is built up in here and then written with
+// a single write(), so i3bar never sees half a line.
+struct LineBuffer {
+    LineBuffer()
+    {
+        buffer.resize(initialCapacity);
+    }
+
+    void append(std::string_view text)
+    {
+        reserve(text.size());
+        memcpy(buffer.data() + length, text.data(), text.size());
+        length += text.size();
+    }
+
+    void append(char c)
+    {
+        reserve(1);
+        buffer[length++] = c;
+    }
+
+    __attribute__((format(printf, 2, 3)))
+    void appendf(const char *format, ...)
+    {
+        while (true) {
+            va_list args;
+            va_start(args, format);
+            const int ret = vsnprintf(buffer.data() + length, buffer.size() - length, format, args);
+            va_end(args);
+
+            if (ret < 0) {
+                return;
+            }
+
+            if (size_t(ret) < buffer.size() - length) {
+                length += ret;
+                return;
+            }
+
+            reserve(ret + 1);
+        }
+    }
+
+    // For anything that doesn't come from us, like notification text or
+    // paths, so it can't break out of the JSON string.
+    void appendEscaped(std::string_view text)
+    {
+        static const char hex[] = "0123456789abcdef";
+
+        for (const char c : text) {
+            switch (c) {
+            case '"':
+                append("\\\"");
+                break;
+
+            case '\\':
+                append("\\\\");
+                break;
+
+            case '\n':
+                append("\\n");
+                break;
+
+            case '\t':
+                append("\\t");
+                break;
+
+            default:
+                if (static_cast<unsigned char>(c) < 0x20) {
+                    const char escaped[] = { '\\', 'u', '0', '0', hex[(c >> 4) & 0xf], hex[c & 0xf] };
+                    append(std::string_view(escaped, sizeof escaped));
+                } else {
+                    append(c);
+                }
+
+                break;
+            }
+        }
+    }
 
-inline void print_sep()
+    std::string_view view() const
+    {
+        return std::string_view(buffer.data(), length);
+    }
+
+    void clear()
+    {
+        length = 0;
+    }
+
+    bool removeSuffix(std::string_view suffix)
+    {
+        if (view().substr(length - std::min(length, suffix.size())) != suffix) {
+            return false;
+        }
+
+        length -= suffix.size();
+        return true;
+    }
+
+    // Writes everything and clears the buffer, returns false on error.
+    bool flush(int fd)
+    {
+        const bool ok = write(fd);
+        clear();
+        return ok;
+    }
+
+    // Same, but keeps the contents
+    bool write(int fd) const
+    {
+        size_t written = 0;
+
+        while (written < length) {
+            g_stats.writes++;
+            const ssize_t ret = ::write(fd, buffer.data() + written, length - written);
+
+            if (ret < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+
+                fprintf(stderr, "Failed to write status line: %s\n", strerror(errno));
+                return false;
+            }
+
+            written += ret;
+        }
+
+        return true;
+    }
+
+private:
+    static constexpr size_t initialCapacity = 8192;
+
+    void reserve(size_t extra)
+    {
+        if (length + extra > buffer.size()) {
+            buffer.resize(std::max(buffer.size() * 2, length + extra));
+        }
+    }
+
+    std::vector<char> buffer;
+    size_t length = 0;
+};
+
+// Ends one segment and starts the next
+inline constexpr std::string_view segment_separator = "\""
+        "  },"
+        "  {   \"full_text\": \"";
+
+inline void print_sep(LineBuffer &out)
 {
-    printf("\""
-           "  },"
-           "  {   \"full_text\": \"");
+    out.append(segment_separator);
 }
 
-inline void print_gray()
+inline void print_gray(LineBuffer &out)
 {
-    printf("\", \"color\": \"#aaaaaa");
+    out.append("\", \"color\": \"#aaaaaa");
 }
 
-inline void print_black()
+inline void print_black(LineBuffer &out)
 {
-    printf("\", \"color\": \"#000000");
+    out.append("\", \"color\": \"#000000");
 }
 
-inline void print_red()
+inline void print_red(LineBuffer &out)
 {
-    printf("\", \"color\": \"#ff9999");
+    out.append("\", \"color\": \"#ff9999");
 }
 
-inline void print_yellow()
+inline void print_yellow(LineBuffer &out)
 {
-    printf("\", \"color\": \"#ffff00");
+    out.append("\", \"color\": \"#ffff00");
 }
 
-inline void print_green()
+inline void print_green(LineBuffer &out)
 {
-    printf("\", \"color\": \"#00ff00");
+    out.append("\", \"color\": \"#00ff00");
 }
 
-inline void print_white()
+inline void print_white(LineBuffer &out)
 {
-    printf("\", \"color\": \"#ffffff");
+    out.append("\", \"color\": \"#ffffff");
 }
 
-inline void print_red_background()
+inline void print_red_background(LineBuffer &out)
 {
-    printf("\", \"background\": \"#ff0000");
+    out.append("\", \"background\": \"#ff0000");
 }
 
-inline void print_white_background()
+inline void print_white_background(LineBuffer &out)
 {
-    printf("\", \"background\": \"#ffffff");
+    out.append("\", \"background\": \"#ffffff");
 }
-
@@ -0,0 +1,200 @@
+#pragma once
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <string>
+
+#include <systemd/sd-bus.h>
+
+// Listens to logind on the system bus, so we know when we're about to
+// suspend and when our session is locked or idle, and can stop collecting
+// things nobody is looking at. Uses the system bus we already have open.
+struct LogindWatcher {
+    LogindWatcher() = default;
+
+    LogindWatcher(const LogindWatcher &) = delete;
+    LogindWatcher &operator=(const LogindWatcher &) = delete;
+
+    ~LogindWatcher()
+    {
+        for (sd_bus_slot *slot : slots) {
+            if (slot) {
+                sd_bus_slot_unref(slot);
+            }
+        }
+    }
+
+    bool connect(sd_bus *systemBus)
+    {
+        bus = systemBus;
+
+        if (!bus) {
+            return false;
+        }
+
+        int ret = sd_bus_match_signal(bus, &slots[0], "org.freedesktop.login1", "/org/freedesktop/login1",
+                                  "org.freedesktop.login1.Manager", "PrepareForSleep", on_prepare_for_sleep, this);
+
+        if (ret < 0) {
+            fprintf(stderr, "Failed to listen for PrepareForSleep: %s\n", strerror(-ret));
+            return false;
+        }
+
+        // Still good for suspend if we're not in a session
+        if (!findSession()) {
+            return true;
+        }
+
+        ret = sd_bus_match_signal(bus, &slots[1], "org.freedesktop.login1", sessionPath.c_str(),
+                                  "org.freedesktop.login1.Session", "Lock", on_lock, this);
+
+        if (ret >= 0) {
+            ret = sd_bus_match_signal(bus, &slots[2], "org.freedesktop.login1", sessionPath.c_str(),
+                                      "org.freedesktop.login1.Session", "Unlock", on_unlock, this);
+        }
+
+        if (ret >= 0) {
+            ret = sd_bus_match_signal(bus, &slots[3], "org.freedesktop.login1", sessionPath.c_str(),
+                                      "org.freedesktop.DBus.Properties", "PropertiesChanged", on_properties_changed, this);
+        }
+
+        if (ret < 0) {
+            fprintf(stderr, "Failed to listen for session changes: %s\n", strerror(-ret));
+        }
+
+        // In case we're started while it's already locked
+        locked = getProperty("LockedHint");
+        idle = getProperty("IdleHint");
+
+        return true;
+    }
+
+    // Nobody is looking, or we're about to suspend
+    bool paused() const
+    {
+        return sleeping || locked || idle;
+    }
+
+    bool sleeping = false;
+    bool locked = false;
+    bool idle = false;
+
+private:
+    bool findSession()
+    {
+        sd_bus_error error = SD_BUS_ERROR_NULL;
+        sd_bus_message *reply = nullptr;
+        const char *path = nullptr;
+
+        int ret = sd_bus_call_method(bus,
+                                     "org.freedesktop.login1",
+                                     "/org/freedesktop/login1",
+                                     "org.freedesktop.login1.Manager",
+                                     "GetSessionByPID",
+                                     &error,
+                                     &reply,
+                                     "u",
+                                     uint32_t(getpid()));
+
+        if (ret < 0) {
+            fprintf(stderr, "Not in a logind session, not watching for lock and idle: %s\n", error.message);
+        } else if (sd_bus_message_read(reply, "o", &path) >= 0 && path) {
+            sessionPath = path;
+        }
+
+        sd_bus_error_free(&error);
+        sd_bus_message_unref(reply);
+
+        return !sessionPath.empty();
+    }
+
+    bool getProperty(const char *name)
+    {
+        sd_bus_error error = SD_BUS_ERROR_NULL;
+        int value = 0;
+
+        const int ret = sd_bus_get_property_trivial(bus, "org.freedesktop.login1", sessionPath.c_str(),
+                        "org.freedesktop.login1.Session", name, &error, 'b', &value);
+
+        if (ret < 0) {
+            fprintf(stderr, "Failed to get %s: %s\n", name, error.message);
+        }
+
+        sd_bus_error_free(&error);
+        return value;
+    }
+
+    static int on_prepare_for_sleep(sd_bus_message *message, void *userdata, sd_bus_error * /*error*/)
+    {
+        LogindWatcher *that = static_cast<LogindWatcher *>(userdata);
+        int sleeping = 0;
+
+        if (sd_bus_message_read(message, "b", &sleeping) >= 0) {
+            that->sleeping = sleeping;
+        }
+
+        return 0;
+    }
+
+    static int on_lock(sd_bus_message * /*message*/, void *userdata, sd_bus_error * /*error*/)
+    {
+        static_cast<LogindWatcher *>(userdata)->locked = true;
+        return 0;
+    }
+
+    static int on_unlock(sd_bus_message * /*message*/, void *userdata, sd_bus_error * /*error*/)
+    {
+        static_cast<LogindWatcher *>(userdata)->locked = false;
+        return 0;
+    }
+
+    // The changed values come with the signal, so no need to ask for them
+    static int on_properties_changed(sd_bus_message *message, void *userdata, sd_bus_error * /*error*/)
+    {
+        LogindWatcher *that = static_cast<LogindWatcher *>(userdata);
+        const char *interface = nullptr;
+
+        if (sd_bus_message_read(message, "s", &interface) < 0 || strcmp(interface, "org.freedesktop.login1.Session") != 0) {
+            return 0;
+        }
+
+        if (sd_bus_message_enter_container(message, 'a', "{sv}") < 0) {
+            return 0;
+        }
+
+        while (sd_bus_message_enter_container(message, 'e', "sv") > 0) {
+            const char *name = nullptr;
+
+            if (sd_bus_message_read(message, "s", &name) < 0) {
+                break;
+            }
+
+            bool *target = nullptr;
+
+            if (strcmp(name, "IdleHint") == 0) {
+                target = &that->idle;
+            } else if (strcmp(name, "LockedHint") == 0) {
+                target = &that->locked;
+            }
+
+            int value = 0;
+
+            if (target && sd_bus_message_read(message, "v", "b", &value) >= 0) {
+                *target = value;
+            } else {
+                sd_bus_message_skip(message, "v");
+            }
+
+            sd_bus_message_exit_container(message);
+        }
+
+        return 0;
+    }
+
+    sd_bus *bus = nullptr; // not ours
+    sd_bus_slot *slots[4] = {};
+    std::string sessionPath;
+};
@@ -5,21 +5,40 @@
 #endif
 
 #include "json_helpers.h"
+#include "filecache.h"
+#include "eventloop.h"
+#include "procparsers.h"
+#include "netlink.h"
+#include "mounts.h"
+#include "diskprobe.h"
+#include "recorder.h"
+#include "stats.h"
+#include "module.h"
+#include "cadence.h"
+#include "logind.h"
+#include "busconnection.h"
+#include "window.h"
+#include "procscan.h"
+#include "pressure.h"
+#include "blockdevices.h"
+#include "batterypredictor.h"
 
 #include <err.h>
 #include <errno.h>
+#include <limits.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/statvfs.h>
 #include <time.h>
 #include <unordered_map>
-#include <unordered_set>
 #include <systemd/sd-bus.h>
+#include <sys/stat.h>
 #include <sys/sysinfo.h>
-#include <mntent.h>
+#include <algorithm>
 #include <cmath>
+#include <array>
+#include <functional>
 
 #include "pulse.h"
 
@@ -31,708 +50,2150 @@ static_assert(net_samples > 1, "net_samples must be greater than 0");
 const unsigned mem_samples = 5;
 static_assert(mem_samples > 1, "mem_samples must be greater than 0");
 
+// how long it takes for a change in cpu usage to be mostly shown
+// setting it to 0 disables smoothing
+const unsigned cpu_smoothing_ms = 2000;
+
+// how much of the time (in hundredths of a percent) tasks can be stalled on
+// memory or io before the pressure segment turns red, and the trigger that
+// wakes us up for it (over 2 seconds, the shortest unprivileged window)
+const unsigned pressure_alert = 1000;
+const unsigned pressure_window_us = 2000000;
+const unsigned pressure_trigger_us = pressure_window_us * pressure_alert / 10000;
+
+// minutes left on battery before it starts flashing, before it turns red and
+// sends a notification, and before it powers off
+const int battery_warning_minutes = 45;
+const int battery_low_minutes = 20;
+const int battery_poweroff_minutes = 5;
+
 static bool g_running = true;
 
-static bool print_disk_info(const char *path)
+// Anything that isn't the clock can be this late
+const unsigned long timerSlackNs = 50 * 1000 * 1000;
+
+// Milliseconds since the epoch, which is what the modules are scheduled on
+static uint64_t realtime_ms()
 {
-    struct statvfs buf;
+    timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return uint64_t(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
+static bool print_disk_info(LineBuffer &out, const std::string &path, const DiskUsage &usage)
+{
+    if (!usage.valid) {
+        // Never got anything, and it's stuck
+        if (usage.stale) {
+            out.appendEscaped(path);
+            out.append(" hung");
+            print_red(out);
+            return true;
+        }
 
-    if (statvfs(path, &buf) == -1) {
-        fprintf(stderr, "error running statvfs on %s: %s\n", path, strerror(errno));
         return false;
     }
 
-    double gb_free = (double)buf.f_bavail * (double)buf.f_bsize / 1000000000.0;
+    const double gb_free = usage.gbFree;
+
+    // Mark it if the probe is taking too long and this is the last value
+    const char *staleMarker = usage.stale ? "?" : "";
+
+    out.appendEscaped(path);
 
     if (gb_free < 1) {
-        printf("%s %.1f GB", path, gb_free);
-        print_red();
+        out.appendf(" %.1f GB%s", gb_free, staleMarker);
+        print_red(out);
     } else if (gb_free < 5) {
-        printf("%s %.1f GB", path, gb_free);
-        print_yellow();
+        out.appendf(" %.1f GB%s", gb_free, staleMarker);
+        print_yellow(out);
     } else {
-        printf("%s %.0f GB", path, gb_free);
-        print_gray();
+        out.appendf(" %.0f GB%s", gb_free, staleMarker);
+        print_gray(out);
     }
     return true;
 }
 
-static void send_notification(const std::string &text, const std::string &iconName)
+static void send_notification(BusConnection *userBus, const char *text, const char *iconName)
 {
-    sd_bus *bus = nullptr;
-    int ret = sd_bus_default_user(&bus);
-    if (ret < 0 || !bus) {
-        perror("Failed to connect to user bus");
+    if (g_recorder.replaying()) {
+        fprintf(stderr, "replay: would send notification '%s'\n", text);
         return;
     }
 
-    sd_bus_error error = SD_BUS_ERROR_NULL;
-    sd_bus_message *dbusRet = nullptr;
-    ret = sd_bus_call_method(bus,
-         "org.freedesktop.Notifications",    /* service to contact */
-         "/org/freedesktop/Notifications",   /* object path */
-         "org.freedesktop.Notifications",    /* interface name */
-         "Notify",                           /* method name */
-         &error,                             /* object to return error in */
-         &dbusRet,                           /* return message on success */
-         /* input signature:            */
-         "s"        /*    - STRING app_name        */
-         "u"        /*    - UINT32 replaces_id     */
-         "s"        /*    - STRING app_icon        */
-         "s"        /*    - STRING summary         */
-         "s"        /*    - STRING body            */
-         "as"       /*    - as actions             */
-         "a{sv}"    /*    - a{sv} hints            */
-          "i"       /*    - INT32 expire_timeout   */
-          ,
-          /* arguments: */
-         "status",          /*    - STRING app_name        */
-         0,                 /*    - UINT32 replaces_id     */
-         iconName.c_str(),  /*    - STRING app_icon        */
-         text.c_str(),      /*    - STRING summary         */
-         "",                /*    - STRING body            */
-         0,                 /*    - as actions             */
-         0,                 /*    - a{sv} hints            */
-         -1                 /*    - INT32 expire_timeout   */
+    userBus->call("send notification",
+                  "org.freedesktop.Notifications",    /* service to contact */
+                  "/org/freedesktop/Notifications",   /* object path */
+                  "org.freedesktop.Notifications",    /* interface name */
+                  "Notify",                           /* method name */
+                  /* input signature:            */
+                  "s"        /*    - STRING app_name        */
+                  "u"        /*    - UINT32 replaces_id     */
+                  "s"        /*    - STRING app_icon        */
+                  "s"        /*    - STRING summary         */
+                  "s"        /*    - STRING body            */
+                  "as"       /*    - as actions             */
+                  "a{sv}"    /*    - a{sv} hints            */
+                  "i"        /*    - INT32 expire_timeout   */
+                  ,
+                  /* arguments: */
+                  "status",          /*    - STRING app_name        */
+                  0,                 /*    - UINT32 replaces_id     */
+                  iconName,          /*    - STRING app_icon        */
+                  text,              /*    - STRING summary         */
+                  "",                /*    - STRING body            */
+                  0,                 /*    - as actions             */
+                  0,                 /*    - a{sv} hints            */
+                  -1                 /*    - INT32 expire_timeout   */
     );
-
-
-    if (ret < 0) {
-        fprintf(stderr, "Failed to issue method call: %s\n", error.message);
-    }
-
-    sd_bus_error_free(&error);
-    sd_bus_message_unref(dbusRet);
-    sd_bus_unref(bus);
-
-    errno = 0;
 }
 
-static void do_poweroff()
+static void do_poweroff(BusConnection *systemBus)
 {
-    sd_bus *bus = nullptr;
-    int ret = sd_bus_open_system(&bus);
-
-    if (ret < 0) {
-        fprintf(stderr, "Failed to connect to system bus: %s", strerror(-ret));
+    if (g_recorder.replaying()) {
+        fprintf(stderr, "replay: would power off\n");
         return;
     }
 
-    sd_bus_error error = SD_BUS_ERROR_NULL;
-    sd_bus_message *dbusRet = nullptr;
-    ret = sd_bus_call_method(bus,
-                             "org.freedesktop.login1",           /* service to contact */
-                             "/org/freedesktop/login1",          /* object path */
-                             "org.freedesktop.login1.Manager",   /* interface name */
-                             "PowerOff",                         /* method name */
-                             &error,                             /* object to return error in */
-                             &dbusRet,                           /* return message on success */
-                             "b",                                /* input signature */
-                             "true");                            /* first argument */
+    systemBus->call("power off",
+                    "org.freedesktop.login1",           /* service to contact */
+                    "/org/freedesktop/login1",          /* object path */
+                    "org.freedesktop.login1.Manager",   /* interface name */
+                    "PowerOff",                         /* method name */
+                    "b",                                /* input signature */
+                    1);                                 /* interactive */
+}
 
-    if (ret < 0) {
-        fprintf(stderr, "Failed to issue method call: %s\n", error.message);
-    }
 
-    sd_bus_error_free(&error);
-    sd_bus_message_unref(dbusRet);
-    sd_bus_unref(bus);
-}
+// Everything comes from udev, the module just shows it. Not adaptive, the
+// udev events drive it anyways, and it's what powers off before the battery
+// runs out, so it shouldn't be slowed down.
+struct BatteryModule : Module {
+    BatteryModule(UdevConnection *udevConnection, BusConnection *userBus, BusConnection *systemBus) :
+        Module("battery", SelfStats::Battery, 60000), // invalidated by the udev events
+        udevConnection(udevConnection),
+        userBus(userBus),
+        systemBus(systemBus)
+    {}
 
+    void update(LineBuffer &out) override
+    {
+        if (!udevConnection->power.valid) {
+            return;
+        }
 
-static void print_battery(UdevConnection *udevConnection)
-{
-    if (!udevConnection->power.valid) {
-        printf("udev invalid, failed to get battery");
-        return;
+        print(out);
+        endSegment(out);
     }
 
-    const bool chargerOnline = udevConnection->power.chargerOnline;
+    void print(LineBuffer &out)
+    {
+        // All the batteries together
+        const UdevConnection::Energy &energy = udevConnection->power.energy;
+        const int percentage = udevConnection->power.percentage;
+        const bool charging = udevConnection->power.chargerOnline;
+
+        const int last_percentage = udevConnection->power.last_percentage;
+        udevConnection->power.last_percentage = percentage;
+
+        predictor.add(lastRunMs, energy.now, energy.powerNow, charging);
+        const int minutes = predictor.minutesLeft(energy.now, energy.full);
+
+        const int lastMinutes = minutesLeft;
+        minutesLeft = minutes;
+
+        if (charging) {
+            flashing = 0;
+            wasLow = wasGettingLow = false;
+            poweroffRequested = false;
+            out.appendf("charging: %d%%", percentage);
+            print_time(out, minutes);
+            print_gray(out);
+            return;
+        }
 
-    FILE *file = fopen("/sys/class/power_supply/BAT0/capacity", "r");
+        // Go by how long it'll actually last when we can tell, and by the
+        // percentage steps when we can't. Never power off on a prediction
+        // alone while there's plenty left, though, and only ask once until
+        // it's charging again, it might want a password.
+        const bool predicted = minutes >= 0;
+        const bool critical = predicted ?
+                              !poweroffRequested && lastMinutes >= 0 && minutes < battery_poweroff_minutes && percentage < 10 :
+                              last_percentage < 100 && percentage < last_percentage && percentage < 5;
+        const bool low = predicted ? minutes < battery_low_minutes : percentage < 10;
+        const bool gettingLow = predicted ? minutes < battery_warning_minutes : percentage < 20;
+
+        if (critical) {
+            do_poweroff(systemBus);
+            poweroffRequested = true;
+        }
 
-    if (!file) {
-        printf("failed to open file for battery");
-        return;
-    }
+        out.appendf("bat: %d%%", percentage);
+        print_time(out, minutes);
 
-    int percentage = -1;
+        if (low) {
+            if (!wasLow) {
+                flashing = 10;
+                send_notification(userBus, "Battery getting low", "battery-caution");
+            }
+            print_red(out);
+        } else if (gettingLow) {
+            if (!wasGettingLow) {
+                flashing = 5;
+            }
+            print_green(out);
+        } else if (percentage > 90) {
+            print_gray(out);
+        }
 
-    if (fscanf(file, "%d", &percentage) != 1) {
-        printf("Failed to read battery capacity");
-        fclose(file);
-        return;
-    }
+        // Like the poweroff, only warn once until it's charging again, the
+        // prediction goes up and down with the load
+        wasLow = wasLow || low;
+        wasGettingLow = wasGettingLow || gettingLow || low;
 
-    fclose(file);
+        if (flashing > 0) {
+            if ((flashing % 2) == 0) {
+                print_red_background(out);
+            }
+            flashing--;
 
-    const bool charging = chargerOnline;
+            // Nothing else would make us run again for a while
+            dirty = true;
+        }
+    }
 
-    static int flashing = 0;
+    static void print_time(LineBuffer &out, int minutes)
+    {
+        if (minutes >= 0) {
+            out.appendf(" %d:%02d", minutes / 60, minutes % 60);
+        }
+    }
 
-    const int last_percentage = udevConnection->power.last_percentage;
-    udevConnection->power.last_percentage = percentage;
+    UdevConnection *udevConnection;
+    BusConnection *userBus;
+    BusConnection *systemBus;
+    int flashing = 0;
 
-    if (charging) {
-        flashing = 0;
-        printf("charging: %d%%", percentage);
-        print_gray();
-        return;
+protected:
+    void resetHistory() override
+    {
+        predictor.clear();
+        minutesLeft = -1;
     }
 
-    if (last_percentage < 100 && percentage < last_percentage && percentage < 5) {
-        do_poweroff();
+private:
+    BatteryPredictor predictor;
+    int minutesLeft = -1;
+    bool wasLow = false;
+    bool wasGettingLow = false;
+    bool poweroffRequested = false;
+};
+
+struct DisksModule : Module {
+    DisksModule(MountWatcher *mountWatcher, DiskProber *diskProber) :
+        Module("disks", SelfStats::Disks, 30000),
+        mountWatcher(mountWatcher),
+        diskProber(diskProber)
+    {
+        adaptive = true;
     }
 
+    void update(LineBuffer &out) override
+    {
+        mountWatcher->update();
 
-    printf("bat: %d%%", percentage);
+        // Might have been updated by the diskio module already
+        if (mountGeneration != mountWatcher->generation) {
+            mountGeneration = mountWatcher->generation;
 
-    if (percentage < 10) {
-        if (last_percentage >= 10) {
-            flashing = 10;
-            send_notification("Battery getting low", "battery-caution");
-        }
-        print_red();
-    } else if (percentage < 20) {
-        if (last_percentage >= 20) {
-            flashing = 5;
+            if (!g_recorder.replaying()) {
+                diskProber->setMounts(mountWatcher->mounts);
+            }
         }
-        print_green();
-    } else if (percentage > 90) {
-        print_gray();
-    }
 
-    if (flashing > 0) {
-        if ((flashing % 2) == 0) {
-            print_red_background();
+        for (const Mount &mount : mountWatcher->mounts) {
+            const DiskUsage usage = g_recorder.capture("disk", mount.path, [&] {
+                return diskProber->get(mount.path);
+            });
+
+            // Don't wait a whole interval for the first results
+            if (usage.pending) {
+                dirty = true;
+            }
+
+            if (print_disk_info(out, mount.path, usage)) {
+                endSegment(out, mount.path);
+            }
         }
-        flashing--;
     }
-}
 
-static unsigned s_cpu_high_seconds = 0;
-static unsigned s_cpu_count = 1;
+    MountWatcher *mountWatcher;
+    DiskProber *diskProber;
+    unsigned mountGeneration = 0;
+};
 
-static void print_cpu()
-{
-    FILE *fp = fopen("/proc/stat", "r");
+// Throughput, iops and how busy the physical disks behind the mounts we show
+// are, so it's possible to tell if the machine is slow because of IO.
+struct DiskIoModule : Module {
+    struct Disk {
+        std::string name;
+        DiskCounters last;
+        bool haveLast = false;
+    };
 
-    if (!fp) {
-        printf("cpu: error opening /proc/stat: %s\n", strerror(errno));
-        return;
+    explicit DiskIoModule(MountWatcher *mountWatcher) :
+        Module("diskio", SelfStats::DiskIo, 1000),
+        mountWatcher(mountWatcher),
+        file("/proc/diskstats")
+    {
+        adaptive = true;
     }
 
-    unsigned user, nice, system, idle, iowait, irq, softirq, steal, guest, guest_nice;
+    void update(LineBuffer &out) override
+    {
+        mountWatcher->update();
 
-    if (!fscanf(fp, "cpu %u %u %u %u %u %u %u %u %u %u",
-                &user, &nice, &system, &idle, &iowait,
-                &irq, &softirq, &steal, &guest, &guest_nice)) {
-        fclose(fp);
-        printf("cpu usage error");
-        return;
-    }
+        if (mountGeneration != mountWatcher->generation) {
+            mountGeneration = mountWatcher->generation;
+            updateDisks();
+        }
 
-    fclose(fp);
+        if (disks.empty()) {
+            return;
+        }
 
-    idle += iowait;
-    unsigned nonidle = user + nice + system + irq + softirq + steal;
-    static unsigned previdle = 0, prevnonidle = 0;
-    const unsigned percent = (nonidle - prevnonidle) * 100.0 / (idle + nonidle - previdle - prevnonidle);
+        const char *contents = file.read();
 
-    printf("cpu: %3u%%", percent);
-    previdle = idle;
-    prevnonidle = nonidle;
+        if (!contents) {
+            out.appendf("diskio: error reading /proc/diskstats: %s", strerror(errno));
+            endSegment(out);
+            return;
+        }
 
-    // Show feedback if CPU (core) is pegged
-    // Approximate core thing, but it works (and is much simpler than parsing
-    // the entire /proc/stat)
-    if (percent * s_cpu_count > 80) {
-        s_cpu_high_seconds++;
-    } else {
-        s_cpu_high_seconds = 0;
-    }
+        // One pass, for all of them
+        parse_diskstats(contents, [&](std::string_view name, const DiskCounters &counters) {
+            for (Disk &disk : disks) {
+                if (disk.name == name) {
+                    printDisk(out, &disk, counters);
+                    endSegment(out, disk.name);
+                }
+            }
 
-    if (s_cpu_high_seconds > 120) {
-        print_red();
-    } else if (s_cpu_high_seconds > 30) {
-        print_yellow();
-    } else {
-        print_gray();
+            return true;
+        });
     }
 
-}
-
-static void print_load()
-{
-    double loadavg;
-
-    if (getloadavg(&loadavg, 1) == -1) {
-        fputs("load: error", stdout);
-        return;
+    void printDisk(LineBuffer &out, Disk *disk, const DiskCounters &counters)
+    {
+        // Nothing to compare with the first time
+        const DiskCounters last = disk->haveLast && elapsedMs ? disk->last : counters;
+        const uint64_t elapsed = std::max<uint64_t>(elapsedMs, 1);
+        disk->last = counters;
+        disk->haveLast = true;
+
+        auto delta = [](unsigned long long now, unsigned long long before) {
+            return now > before ? now - before : 0;
+        };
+
+        // Sectors are always 512 bytes here
+        const unsigned long readKb = delta(counters.sectorsRead, last.sectorsRead) / 2 * 1000 / elapsed;
+        const unsigned long writeKb = delta(counters.sectorsWritten, last.sectorsWritten) / 2 * 1000 / elapsed;
+        const unsigned long iops = (delta(counters.reads, last.reads) + delta(counters.writes, last.writes)) * 1000 / elapsed;
+        const unsigned long util = std::min<unsigned long long>(delta(counters.ioTicksMs, last.ioTicksMs) * 100 / elapsed, 100);
+
+        out.append(disk->name);
+        out.append(' ');
+        print_rate(out, "r", readKb);
+        print_rate(out, "w", writeKb);
+        out.appendf("%4lu iops %3lu%%", iops, util);
+
+        busy = busy || util >= 50;
+
+        if (util >= 90) {
+            print_red(out);
+        } else if (util >= 50) {
+            print_yellow(out);
+        } else if (util < 10) {
+            print_gray(out);
+        }
     }
 
-    printf("load: %1.2f", loadavg);
-
-    // Only print high load if CPU is not attracting attention
-    if (loadavg > 2 && s_cpu_high_seconds < 30) {
-        print_yellow();
-    } else if (loadavg < 1) {
-        print_gray();
+    // Switches to mb once it's a whole one, so it never shows 0.1mb
+    static void print_rate(LineBuffer &out, const char *label, unsigned long kb)
+    {
+        if (kb >= 1024) {
+            out.appendf("%s: %5.1fmb ", label, kb / 1024.);
+        } else {
+            out.appendf("%s: %5lukb ", label, kb);
+        }
     }
-}
 
-static bool print_wifi_strength(const std::string &interface, const bool ignoreErrors)
-{
+    // Only when the mounts change, it has to look around in /sys
+    void updateDisks()
     {
-        FILE *fp = fopen(("/sys/class/net/" + interface + "/carrier").c_str(), "r");
+        std::vector<std::string> names;
 
-        if (!fp) {
-            if (!ignoreErrors) {
-                printf("Unable to get carrier status for wifi");
-                print_sep();
+        if (!g_recorder.replaying()) {
+            for (const Mount &mount : mountWatcher->mounts) {
+                const size_t found = names.size();
+                find_physical_disks(mount.device, &names);
+
+                if (names.size() == found) {
+                    if (const dev_t source = mount_source_device(mount.source)) {
+                        find_physical_disks(source, &names);
+                    }
+                }
             }
-            return false;
         }
 
-        char *line = nullptr;
-        size_t len;
-        getline(&line, &len, fp);
-        fclose(fp);
+        g_recorder.strings("diskio", "disks", &names);
 
-        if (strcmp(line, "0\n") == 0) {
-            if (!ignoreErrors) {
-                printf("wifi down");
-                print_red();
+        std::vector<Disk> newDisks;
+
+        for (std::string &name : names) {
+            auto existing = std::find_if(disks.begin(), disks.end(), [&](const Disk &disk) {
+                return disk.name == name;
+            });
+
+            if (existing != disks.end()) {
+                newDisks.push_back(std::move(*existing));
+            } else {
+                newDisks.push_back({ std::move(name), {}, false });
             }
-            free(line);
-            return false;
         }
 
-        free(line);
+        disks = std::move(newDisks);
     }
 
-    FILE *fp = fopen("/proc/net/wireless", "r");
-
-    if (!fp) {
-        if (!ignoreErrors) {
-            printf("wifi: error opening /proc/net/wireless: %s\n", strerror(errno));
+protected:
+    void resetHistory() override
+    {
+        for (Disk &disk : disks) {
+            disk.haveLast = false;
         }
-        return false;
     }
 
-    char *ln = nullptr;
-    int strength = -1.0;
+private:
+    MountWatcher *mountWatcher;
+    CachedFile file;
+    std::vector<Disk> disks;
+    unsigned mountGeneration = 0;
+};
 
-    const std::string matchString = " " + interface + ": %*u %d. %*f %*d %*u %*u %*u %*u %*u %*u";
+struct CpuModule : Module {
+    explicit CpuModule(ProcessScanner *scanner) :
+        Module("cpu", SelfStats::Cpu, 1000),
+        scanner(scanner),
+        file("/proc/stat")
+    {
+        adaptive = true;
+    }
 
-    for (size_t len = 0; getline(&ln, &len, fp) != -1;) {
-        if (sscanf(ln, matchString.c_str(), &strength) == 1) {
-            break;
-        }
+    void update(LineBuffer &out) override
+    {
+        print(out);
+        endSegment(out);
     }
 
-    free(ln);
-    fclose(fp);
+    void print(LineBuffer &out)
+    {
+        const char *stat = file.read();
 
-    if (strength < 0) {
-        if (!ignoreErrors) {
-            printf("wifi down");
-            print_red();
+        if (!stat) {
+            out.appendf("cpu: error reading /proc/stat: %s", strerror(errno));
+            return;
         }
-        return false;
-    } else {
-        printf("wifi: %3d%%", strength * 100 / 70);
 
-        if (strength > 30) {
-            print_gray();
+        CpuTimes times;
+
+        if (!parse_proc_stat(stat, &times)) {
+            out.append("cpu usage error");
+            return;
         }
-    }
-    return true;
-}
 
-static bool print_net_usage(const std::string &device)
-{
-    static std::unordered_set<std::string> inited;
+        const unsigned long long idle = times.idle + times.iowait;
+        const unsigned long long nonidle = times.user + times.nice + times.system + times.irq + times.softirq + times.steal;
 
-    {
-        FILE *fp = fopen(("/sys/class/net/" + device + "/carrier").c_str(), "r");
+        // Start over from here instead of from the last sample. Without one
+        // there's only the average since boot, which shouldn't be shown or
+        // go into the history.
+        if (!haveBaseline) {
+            previdle = idle;
+            prevnonidle = nonidle;
+            haveBaseline = true;
 
-        if (!fp) {
-            inited.erase(device);
-            return false;
+            out.appendf("cpu: %3.0f%%", smoothed.value());
+            print_gray(out);
+            return;
         }
 
-        const char status = getc(fp);
-        fclose(fp);
-
-        if (status != '1') {
-            inited.erase(device);
-            return false;
-        }
-    }
+        const unsigned long long total = idle + nonidle - previdle - prevnonidle;
 
-    FILE *fp = fopen("/proc/net/dev", "r");
+        // No ticks since last time if we're called twice in the same jiffy
+        const unsigned percent = total ? (nonidle - prevnonidle) * 100 / total : 0;
+        previdle = idle;
+        prevnonidle = nonidle;
 
-    if (!fp) {
-        inited.erase(device);
-        return false;
-    }
+        out.appendf("cpu: %3.0f%%", smoothed.add(percent, elapsedMs));
 
-    static std::unordered_map < std::string, std::array < unsigned long, 1 + net_samples >> rx_map;
-    static std::unordered_map < std::string, std::array < unsigned long, 1 + net_samples >> tx_map;
-    size_t *rx = rx_map[device].data();
-    size_t *tx = tx_map[device].data();
+        // Show feedback if CPU (core) is pegged
+        // Approximate core thing, but it works (and is much simpler than parsing
+        // the entire /proc/stat)
+        busy = percent * count > 80;
+        lowest.push(lastRunMs, percent * count);
 
-    char *ln = nullptr;
+        if (pegged(30000)) {
+            print_top(out);
+        } else {
+            scanner->release(ProcessScanner::Cpu);
+        }
 
-    for (size_t len = 0; getline(&ln, &len, fp) != -1;) {
-        if (sscanf(ln, (" " + device + ": %lu %*u %*u %*u %*u %*u %*u %*u %lu").c_str(),
-                   &rx[net_samples], &tx[net_samples]) == 2) {
-            break;
+        if (pegged(120000)) {
+            print_red(out);
+        } else if (pegged(30000)) {
+            print_yellow(out);
+        } else {
+            print_gray(out);
         }
     }
 
-    free(ln);
-    fclose(fp);
-
-    if (inited.find(device) == inited.end()) {
-        for (unsigned i = 0; i < net_samples; i++) {
-            rx[i] = rx[net_samples];
-            tx[i] = tx[net_samples];
+    // Who's doing it
+    void print_top(LineBuffer &out)
+    {
+        const TopProcess top = g_recorder.capture("procscan", "cpu", [&] {
+            return scanner->top(ProcessScanner::Cpu, lastRunMs);
+        });
+
+        if (top.name[0]) {
+            out.append(" (");
+            out.appendEscaped(top.name);
+            out.append(")");
         }
+    }
 
-        inited.insert(device);
+    // If it has been busy the whole time, for at least that long
+    bool pegged(uint64_t spanMs) const
+    {
+        return lowest.covers(lastRunMs, spanMs) && lowest.get(lastRunMs, spanMs, 0) > 80;
     }
 
-    unsigned long rx_delta = 0;
-    unsigned long tx_delta = 0;
+    unsigned count = 1;
 
-    for (unsigned i = 0; i < net_samples; i++) {
-        rx_delta += rx[i + 1] - rx[i];
-        tx_delta += tx[i + 1] - tx[i];
+protected:
+    void resetHistory() override
+    {
+        haveBaseline = false;
+        smoothed.clear();
+        lowest.clear();
+        scanner->release(ProcessScanner::Cpu);
     }
 
-    rx_delta /= net_samples + 1;
-    tx_delta /= net_samples + 1;
+private:
+    ProcessScanner *scanner;
+    CachedFile file;
+    unsigned long long previdle = 0, prevnonidle = 0;
+    bool haveBaseline = false;
 
-    rx_delta /= 1024;
-    tx_delta /= 1024;
+    Ewma<cpu_smoothing_ms> smoothed;
 
-    if (rx_delta > 100) {
-        printf("rx: %5.1fmb ", rx_delta / 1024.);
-    } else {
-        printf("rx: %5lukb ", rx_delta);
-    }
+    // Lowest usage over the last two minutes, to see how long it has been
+    // pegged for
+    WindowedMinMax<unsigned, 128, 120000, std::less<unsigned>> lowest;
+};
 
-    if (tx_delta > 100) {
-        printf("tx: %5.1fmb", tx_delta / 1024.);
-    } else {
-        printf("tx: %5lukb", tx_delta);
+struct LoadModule : Module {
+    explicit LoadModule(const CpuModule *cpu) :
+        Module("load", SelfStats::Load, 5000), // the kernel only updates it every 5 seconds anyways
+        cpu(cpu),
+        file("/proc/loadavg")
+    {
+        adaptive = true;
     }
 
-    if (rx_delta < 512 && tx_delta < 512) {
-        print_gray();
+    void update(LineBuffer &out) override
+    {
+        print(out);
+        endSegment(out);
     }
 
-    memmove(rx, rx + 1, sizeof rx[0] * net_samples);
-    memmove(tx, tx + 1, sizeof tx[0] * net_samples);
+    void print(LineBuffer &out)
+    {
+        // Same as getloadavg(), but goes through the root prefix
+        const char *contents = file.read();
+        char *end = nullptr;
+        const double loadavg = contents ? strtod(contents, &end) : 0;
+
+        if (!contents || end == contents) {
+            out.append("load: error");
+            return;
+        }
 
-    return true;
-}
+        out.appendf("load: %1.2f", loadavg);
 
-static void print_mem()
-{
-    FILE *fp = fopen("/proc/meminfo", "r");
+        // Per core, so more than one runnable task for each
+        const double perCore = loadavg / std::max(cpu->count, 1u);
 
-    if (!fp) {
-        printf("mem: error opening /proc/meminfo: %s\n", strerror(errno));
-        return;
+        // Only print high load if CPU is not attracting attention
+        if (perCore > 1 && !cpu->pegged(30000)) {
+            print_yellow(out);
+        } else if (perCore < 0.5) {
+            print_gray(out);
+        }
     }
 
-    char *line = nullptr;
-    unsigned long memtotal = 0, memavailable = 0;
+    const CpuModule *cpu;
+    CachedFile file;
+};
+
+// How much of the last 10 seconds something had to wait for the cpu, memory
+// or io (some/full, see Documentation/accounting/psi.rst). The averages are
+// only updated every 2 seconds, so the memory and io ones also have triggers
+// that wake us up as soon as they stall.
+struct PressureModule : Module {
+    enum Resource {
+        Cpu,
+        Memory,
+        Io,
+        ResourceCount
+    };
+
+    PressureModule() :
+        Module("pressure", SelfStats::Pressure, 2000),
+        files{ CachedFile("/proc/pressure/cpu"), CachedFile("/proc/pressure/memory"), CachedFile("/proc/pressure/io") }
+    {
+        adaptive = true;
+    }
 
-    for (size_t len = 0; getline(&line, &len, fp) != -1;) {
-        sscanf(line, "MemTotal: %lu kB", &memtotal);
-        sscanf(line, "MemAvailable: %lu kB", &memavailable);
+    // Falls back to just reading the averages if we're not allowed
+    void armTriggers()
+    {
+        for (int i = Memory; i < ResourceCount; i++) {
+            triggers[i].arm(files[i].path.c_str(), "some", pressure_trigger_us, pressure_window_us);
+        }
     }
 
-    free(line);
+    void update(LineBuffer &out) override
+    {
+        PressureStats stats[ResourceCount];
+
+        for (int i = 0; i < ResourceCount; i++) {
+            const char *contents = files[i].read();
+
+            // Kernel without PSI, or booted with psi=0
+            if (!contents || !parse_pressure(contents, &stats[i])) {
+                return;
+            }
+        }
+
+        // The trigger only says that it happened, so stay red until the
+        // averages have had time to catch up
+        bool alert = false;
+
+        for (int i = Memory; i < ResourceCount; i++) {
+            g_recorder.value("pressure", names[i], &stalled[i]);
+
+            if (stalled[i]) {
+                lastStallMs[i] = lastRunMs;
+                stalled[i] = false;
+            }
 
-    const long used = memtotal - memavailable;
+            if ((lastStallMs[i] && lastRunMs - lastStallMs[i] < 10000) || stats[i].someAvg10 >= pressure_alert) {
+                alert = true;
+            }
+        }
 
-    static long last_used[1 + mem_samples];
+        // Full for the cpu is always 0 for the whole system
+        out.appendf("psi: cpu %.1f mem %.1f/%.1f io %.1f/%.1f",
+                    stats[Cpu].someAvg10 / 100.0,
+                    stats[Memory].someAvg10 / 100.0, stats[Memory].fullAvg10 / 100.0,
+                    stats[Io].someAvg10 / 100.0, stats[Io].fullAvg10 / 100.0);
 
-    static bool first_run = true;
+        busy = alert;
 
-    if (first_run) {
-        for (unsigned i = 0; i < mem_samples; i++) {
-            last_used[i] = used;
+        if (alert) {
+            print_red(out);
+        } else if (stats[Cpu].someAvg10 >= pressure_alert) {
+            print_yellow(out);
+        } else if (std::max({ stats[Cpu].someAvg10, stats[Memory].someAvg10, stats[Io].someAvg10 }) < 100) {
+            print_gray(out);
         }
 
-        first_run = false;
+        endSegment(out);
     }
 
-    long accum = used;
+    // Set from the event loop when a trigger fires
+    bool stalled[ResourceCount] = {};
 
-    for (unsigned i = 0; i < mem_samples; i++) {
-        accum += last_used[i];
+    PressureTrigger triggers[ResourceCount];
+
+protected:
+    void resetHistory() override
+    {
+        std::fill(std::begin(lastStallMs), std::end(lastStallMs), 0);
     }
 
-    accum /= mem_samples + 1;
+private:
+    static constexpr const char *names[ResourceCount] = { "cpu", "memory", "io" };
 
-    last_used[mem_samples] = used;
-    memmove(last_used, last_used + 1, sizeof last_used[0] * mem_samples);
+    CachedFile files[ResourceCount];
+    uint64_t lastStallMs[ResourceCount] = {};
+};
 
-    int percentage = std::round(used * 100.0 / memtotal);
-    printf("mem: %3d%%", percentage);
+struct NetModule : Module {
+    struct Device {
+        int index = 0;
+        NetDevCounters counters;
+        bool present = false;
+        bool carrier = false;
+    };
 
-    if (percentage > 80 || used - accum > 1024 * 512) {
-        print_red();
-    } else if (percentage < 40) {
-        print_gray();
+    NetModule(RtnetlinkConnection *rtnetlink, UdevConnection *udevConnection) :
+        Module("net", SelfStats::Net, 1000),
+        rtnetlink(rtnetlink),
+        udevConnection(udevConnection),
+        netDevFile("/proc/net/dev")
+    {
+        adaptive = true;
     }
 
-    fclose(fp);
-}
+    void update(LineBuffer &out) override
+    {
+        updateInterfaces();
 
-static void print_time(time_t offset = 0)
-{
-    time_t now;
-    tm result;
+        {
+            PhaseTimer timer(SelfStats::NetRead);
+            readCounters();
+        }
 
-    time(&now);
-    char buf[sizeof "week 43 Fri 2015-10-30 12:44:52"];
+        g_recorder.value("click", "net", &focus);
 
-    if (offset) {
-        now += offset;
-        strftime(buf, sizeof buf, "%H:%M", localtime_r(&now, &result));
-        fputs(buf, stdout);
-        print_gray();
-    } else {
-        strftime(buf, sizeof buf, "week %V %a %F", localtime_r(&now, &result));
-        fputs(buf, stdout);
-        print_gray();
-        print_sep();
-        strftime(buf, sizeof buf, "%T", localtime_r(&now, &result));
-        fputs(buf, stdout);
-    }
-}
+        if (focus >= int(interfaces.size())) {
+            focus = -1;
+        }
 
-static void print_volume(PulseClient &client)
-{
-    client.Populate();
-    const Sink *device = client.GetDefaultSink();
+        hasEthernet = false;
 
-    if (!device) {
-        printf("couldn't find default sink");
-        print_red();
-        return;
-    }
+        for (size_t i = 0; i < interfaces.size(); i++) {
+            Interface &interface = interfaces[i];
 
-    printf("vol: %3d%%", device->Volume());
+            // Keep the history going even for the ones we don't show
+            Rates rates;
+            const bool up = updateRates(&interface, &rates);
 
-    if (device->Muted()) {
-        print_gray();
-    } else {
-        print_green();
-    }
-}
+            if (up && !interface.wlan) {
+                hasEthernet = true;
+            }
 
-static std::vector<std::string> getPartitions()
-{
-    FILE *file = setmntent("/proc/mounts", "r");
+            if (up && (rates.rxKb >= 512 || rates.txKb >= 512)) {
+                busy = true;
+            }
+
+            if (focus < 0 && up) {
+                printRates(out, rates);
+                endSegment(out, interface.name);
+            } else if (focus == int(i)) {
+                out.appendEscaped(interface.name);
+                out.append(": ");
+
+                if (up) {
+                    printRates(out, rates);
+                } else {
+                    out.append("down");
+                    print_gray(out);
+                }
 
-    if (file == NULL) {
-        fprintf(stderr, "Failed to open /proc/mounts");
-        return {};
+                endSegment(out, interface.name);
+            }
+        }
     }
 
-    std::vector<std::string> partitions;
-    mntent *ent = nullptr;
+    // Left click shows only one of the interfaces that are up, and then the
+    // next one, until it's back to showing all of them. Right click goes
+    // straight back.
+    bool click(const ClickEvent &event) override
+    {
+        if (event.button == ButtonRight) {
+            const bool changed = focus >= 0;
+            focus = -1;
+            return changed;
+        }
 
-    while ((ent = getmntent(file))) {
-        if (std::string(ent->mnt_type) != "ext4") {
-            continue;
+        if (event.button != ButtonLeft) {
+            return false;
         }
 
-        partitions.push_back(ent->mnt_dir);
-    }
+        for (size_t i = focus + 1; i < interfaces.size(); i++) {
+            if (interfaces[i].device.present && interfaces[i].device.carrier) {
+                focus = i;
+                return true;
+            }
+        }
 
-    endmntent(file);
+        focus = -1;
+        return true;
+    }
 
-    return partitions;
-}
+    // Link went up or down, so we don't have to wait for the next dump
+    void processMonitor()
+    {
+        rtnetlink->processMonitor([&](std::string_view name, const LinkState &state) {
+            if (Interface *interface = find(name)) {
+                interface->device.carrier = state.up;
+            }
+        });
 
-struct Status
-{
-    Status() : client("status")
-    {}
+        invalidate();
+    }
 
-    void init()
+    // Returns nullptr if it's not one of the interfaces we show
+    const Device *device(std::string_view name) const
     {
-        mountPoints = getPartitions();
+        const Interface *interface = find(name);
+        return interface ? &interface->device : nullptr;
+    }
 
-#ifdef ENABLE_NOTIFICATIONS
-        int dbus_fd = -1;
-        int ret = sd_bus_default_user(&bus);
-
-        if (ret < 0) {
-            fprintf(stderr, "Failed to connect to system bus: %s\n", strerror(-ret));
-            bus = nullptr;
-        } else if (register_notification_service(bus, &slot)) {
-            dbus_fd = sd_bus_get_fd(bus);
-        } else {
-            fprintf(stderr, "Not using notifications\n");
-        
-#endif
+    bool hasEthernet = false;
 
-        s_cpu_count = get_nprocs();
-    }
+    // Which interface to show on its own, counting the ethernet ones first,
+    // or -1 for all of them
+    int focus = -1;
 
-    bool print()
-    {
-        printf(" [ { \"full_text\": \"");
+private:
+    struct Rates {
+        unsigned long rxKb = 0;
+        unsigned long txKb = 0;
+    };
 
-#ifdef ENABLE_NOTIFICATIONS
+    struct Interface {
+        explicit Interface(const std::string &name, bool wlan) :
+            name(name),
+            wlan(wlan),
+            carrierFile("/sys/class/net/" + name + "/carrier")
+        {}
+
+        std::string name;
+        bool wlan;
+        Device device;
+        CachedFile carrierFile;
+
+        // What came in and went out, and how long it took, for each of the
+        // last samples, so the rate is the sum of one over the other
+        SlidingWindow<uint64_t, net_samples> rxBytes;
+        SlidingWindow<uint64_t, net_samples> txBytes;
+        SlidingWindow<uint64_t, net_samples> elapsedMs;
+        NetDevCounters last;
+        uint64_t lastMs = 0;
+        int lastIndex = 0;
+        bool haveLast = false;
+    };
 
-        if (!g_notifications.empty()) {
-            print_notification(&g_notifications.front());
-            print_sep();
+    // They're only known for sure (e. g. from a recording) when we're first
+    // run, and start over if they change. Going by the names, one could have
+    // been renamed or replaced by another one with the same number of them.
+    void updateInterfaces()
+    {
+        const std::vector<std::string> &ethernet = udevConnection->ethernetInterfaces;
+        const std::vector<std::string> &wlan = udevConnection->wlanInterfaces;
+
+        if (sameInterfaces(ethernet, wlan)) {
+            return;
         }
 
-#endif
+        interfaces.clear();
+        interfaces.reserve(ethernet.size() + wlan.size());
+        focus = -1;
 
-        if (udevConnection.power.valid) {
-            print_battery(&udevConnection);
-            print_sep();
+        for (const std::string &name : ethernet) {
+            interfaces.emplace_back(name, false);
         }
 
-        if (mountPoints.empty()) {
-            fprintf(stderr, "partitions gone?");
-            mountPoints = getPartitions();
+        for (const std::string &name : wlan) {
+            interfaces.emplace_back(name, true);
         }
 
-        bool failed = false;
-        for (const std::string &partition : mountPoints) {
-            if (print_disk_info(partition.c_str())) {
-                print_sep();
-            } else {
-                fprintf(stderr, "partition %s gone?", partition.c_str());
-                failed = true;
-            }
-        }
-        if (failed) {
-            mountPoints = getPartitions();
-        }
+        // Points into the names above, so only once they're all in place
+        byName.clear();
 
-        bool hasEthernet = false;
-        for (const std::string &dev : udevConnection.ethernetInterfaces) {
-            hasEthernet = print_net_usage(dev) || hasEthernet;
-            print_sep();
+        for (size_t i = 0; i < interfaces.size(); i++) {
+            byName.emplace_back(interfaces[i].name, i);
         }
 
-        for (const std::string &dev : udevConnection.wlanInterfaces) {
-            if (print_net_usage(dev)) {
-                print_sep();
-            }
-        }
+        std::sort(byName.begin(), byName.end());
+    }
 
-        if (!ignoreWifi) {
-            for (const std::string &dev : udevConnection.wlanInterfaces) {
-                if (print_wifi_strength(dev, hasEthernet)) {
-                    print_sep();
-                }
-            }
+    bool sameInterfaces(const std::vector<std::string> &ethernet, const std::vector<std::string> &wlan) const
+    {
+        if (interfaces.size() != ethernet.size() + wlan.size()) {
+            return false;
         }
 
-        print_load();
-        print_sep();
-        print_mem();
-        print_sep();
-        print_cpu();
-        print_sep();
-        print_volume(client);
-        print_sep();
-        print_time();
+        for (size_t i = 0; i < interfaces.size(); i++) {
+            const bool isWlan = i >= ethernet.size();
+            const std::string &name = isWlan ? wlan[i - ethernet.size()] : ethernet[i];
 
-        printf("\" } ],\n");
-        fflush(stdout);
+            if (interfaces[i].wlan != isWlan || interfaces[i].name != name) {
+                return false;
+            }
+        }
 
-        // Wait for either 1 second or for an udev event (or dbus event in case
-        // notifications is enabled).
-        fd_set fdset;
-        FD_ZERO(&fdset);
-        FD_SET(udevConnection.udevSocketFd, &fdset);
+        return true;
+    }
 
-#ifdef ENABLE_NOTIFICATIONS
-        FD_SET(dbus_fd, &fdset);
-#endif
+    // Returns nullptr if it's not one of the interfaces we show
+    Interface *find(std::string_view name)
+    {
+        return const_cast<Interface *>(std::as_const(*this).find(name));
+    }
 
-        timeval timeout;
-        timeout.tv_sec = 1;
-        timeout.tv_usec = 0; // 1s
-        const int udevEvents = select(udevConnection.udevSocketFd + 1, &fdset, 0, 0, &timeout);
-        const bool wasUdevEvent = FD_ISSET(udevConnection.udevSocketFd, &fdset); // not strictly necessary I guess
+    const Interface *find(std::string_view name) const
+    {
+        auto it = std::lower_bound(byName.begin(), byName.end(), name, [](const auto &entry, std::string_view wanted) {
+            return entry.first < wanted;
+        });
 
-        if (errno != 0) {
-            fprintf(stderr, "got error while selecting: %s\n", strerror(errno));
-            return false;
+        if (it == byName.end() || it->first != name) {
+            return nullptr;
         }
 
-        udevConnection.update(wasUdevEvent && udevEvents > 0);
+        return &interfaces[it->second];
+    }
 
-#ifdef ENABLE_NOTIFICATIONS
-        if (dbus_fd >= 0 && FD_ISSET(dbus_fd, &fdset)) {
-            fprintf(stderr, "processing dbus\n");
-            process_bus(bus);
+    void readCounters()
+    {
+        if (!g_recorder.replaying()) {
+            // Only record what we ended up with, not all of /proc/net/dev
+            Recorder::Pause pause(&g_recorder);
+            readLiveCounters();
         }
 
-        if (!g_notifications.empty()) {
-            if (g_notifications.front().timeout-- <= 0) {
-                g_notifications.erase(g_notifications.begin());
-            }
+        for (Interface &interface : interfaces) {
+            g_recorder.value("net", interface.name, &interface.device);
         }
-#endif
-
-        return true;
     }
 
-    ~Status()
+    // Gets the counters and carrier state for all the interfaces we show in
+    // one go, preferably with a single rtnetlink dump, otherwise with one pass
+    // over /proc/net/dev plus the carrier files.
+    void readLiveCounters()
     {
-#ifdef ENABLE_NOTIFICATIONS
-        if (slot) {
-            sd_bus_slot_unref(slot);
+        for (Interface &interface : interfaces) {
+            interface.device.present = false;
         }
 
-        if (bus) {
-            sd_bus_unref(bus);
-        }
-#endif
-    }
+        const bool dumped = rtnetlink->dumpLinks([&](std::string_view name, const LinkState &state) {
+            Interface *interface = find(name);
 
-    bool ignoreWifi = false;
-    std::vector<std::string> mountPoints;
+            if (interface && state.haveCounters) {
+                interface->device.index = state.index;
+                interface->device.counters = state.counters;
+                interface->device.carrier = state.up;
+                interface->device.present = true;
+            }
+        });
 
-    UdevConnection udevConnection;
+        if (dumped) {
+            return;
+        }
 
-    PulseClient client;
+        const char *netdev = netDevFile.read();
+
+        if (!netdev) {
+            return;
+        }
+
+        size_t remaining = interfaces.size();
+
+        parse_net_dev(netdev, [&](std::string_view name, const NetDevCounters &counters) {
+            Interface *interface = find(name);
+
+            if (!interface) {
+                return true;
+            }
+
+            Device &device = interface->device;
+            device.counters = counters;
+            device.present = true;
+
+            if (!device.index) {
+                device.index = if_nametoindex(interface->name.c_str());
+            }
+
+            const char *carrier = interface->carrierFile.read();
+            device.carrier = carrier && carrier[0] == '1';
+
+            return --remaining > 0;
+        });
+    }
+
+    bool updateRates(Interface *interface, Rates *rates)
+    {
+        const Device &device = interface->device;
+
+        if (!device.present || !device.carrier) {
+            clearHistory(interface);
+            return false;
+        }
+
+        // Another device got the name, e. g. a different USB adapter, or the
+        // driver reset them, so the counters started over
+        if (interface->haveLast && (device.index != interface->lastIndex ||
+                                    device.counters.rxBytes < interface->last.rxBytes ||
+                                    device.counters.txBytes < interface->last.txBytes)) {
+            clearHistory(interface);
+        }
+
+        if (interface->haveLast) {
+            interface->rxBytes.push(device.counters.rxBytes - interface->last.rxBytes);
+            interface->txBytes.push(device.counters.txBytes - interface->last.txBytes);
+            interface->elapsedMs.push(lastRunMs - interface->lastMs);
+        }
+
+        interface->last = device.counters;
+        interface->lastMs = lastRunMs;
+        interface->lastIndex = device.index;
+        interface->haveLast = true;
+
+        // We don't always run at the same interval, so go by the time
+        const uint64_t elapsed = interface->elapsedMs.sum();
+        rates->rxKb = elapsed ? interface->rxBytes.sum() * 1000 / elapsed / 1024 : 0;
+        rates->txKb = elapsed ? interface->txBytes.sum() * 1000 / elapsed / 1024 : 0;
+
+        return true;
+    }
+
+    void printRates(LineBuffer &out, const Rates &rates)
+    {
+        if (rates.rxKb > 100) {
+            out.appendf("rx: %5.1fmb ", rates.rxKb / 1024.);
+        } else {
+            out.appendf("rx: %5lukb ", rates.rxKb);
+        }
+
+        if (rates.txKb > 100) {
+            out.appendf("tx: %5.1fmb", rates.txKb / 1024.);
+        } else {
+            out.appendf("tx: %5lukb", rates.txKb);
+        }
+
+        if (rates.rxKb < 512 && rates.txKb < 512) {
+            print_gray(out);
+        }
+    }
+
+    static void clearHistory(Interface *interface)
+    {
+        interface->rxBytes.clear();
+        interface->txBytes.clear();
+        interface->elapsedMs.clear();
+        interface->haveLast = false;
+    }
+
+    void resetHistory() override
+    {
+        for (Interface &interface : interfaces) {
+            clearHistory(&interface);
+        }
+    }
+
+    RtnetlinkConnection *rtnetlink;
+    UdevConnection *udevConnection;
+
+    CachedFile netDevFile;
+
+    // Ethernet first, then wlan, in the same order as in udevConnection
+    std::vector<Interface> interfaces;
+
+    // Sorted on name, to look up the index in interfaces
+    std::vector<std::pair<std::string_view, size_t>> byName;
+};
+
+// Rough link quality from the signal strength, -50 dBm or better is 100%
+static int wifi_quality(int signalDbm)
+{
+    return std::clamp(2 * (signalDbm + 100), 0, 100);
+}
+
+struct WifiModule : Module {
+    WifiModule(const NetModule *net, Nl80211Connection *nl80211, UdevConnection *udevConnection) :
+        Module("wifi", SelfStats::Wifi, 1000),
+        net(net),
+        nl80211(nl80211),
+        udevConnection(udevConnection),
+        file("/proc/net/wireless")
+    {
+        adaptive = true;
+    }
+
+    void update(LineBuffer &out) override
+    {
+        for (const std::string &dev : udevConnection->wlanInterfaces) {
+            if (print(out, dev, net->hasEthernet)) {
+                endSegment(out, dev);
+            }
+        }
+    }
+
+    bool print(LineBuffer &out, const std::string &interface, const bool ignoreErrors)
+    {
+        int ifindex = 0;
+
+        {
+            const NetModule::Device *netDevice = net->device(interface);
+
+            if (!netDevice || !netDevice->present) {
+                if (!ignoreErrors) {
+                    out.append("Unable to get carrier status for wifi");
+                    endSegment(out, interface);
+                }
+                return false;
+            }
+
+            if (!netDevice->carrier) {
+                if (!ignoreErrors) {
+                    out.append("wifi down");
+                    print_red(out);
+                    endSegment(out, interface);
+                }
+                return false;
+            }
+
+            ifindex = netDevice->index;
+        }
+
+        WifiStation station;
+        const bool haveStation = g_recorder.capture("wifi", interface, [&] {
+            return nl80211->getStation(ifindex, &station);
+        });
+        g_recorder.value("station", interface, &station);
+
+        if (haveStation) {
+            const int quality = wifi_quality(station.signalDbm);
+
+            out.append("wifi: ");
+
+            if (station.ssid[0]) {
+                out.appendEscaped(station.ssid);
+                out.append(' ');
+            }
+
+            out.appendf("%3d%% %uM", quality, station.txBitrate / 10);
+
+            if (quality > 40) {
+                print_gray(out);
+            }
+
+            return true;
+        }
+
+        // No nl80211, so use the old wireless extensions interface
+        const char *wireless = file.read();
+
+        if (!wireless) {
+            if (!ignoreErrors) {
+                out.appendf("wifi: error reading /proc/net/wireless: %s", strerror(errno));
+                endSegment(out, interface);
+            }
+            return false;
+        }
+
+        int strength = -1.0;
+
+        const std::string matchString = " " + interface + ": %*u %d. %*f %*d %*u %*u %*u %*u %*u %*u";
+
+        for (const char *line = wireless; line && *line; line = strchr(line, '\n')) {
+            if (*line == '\n') {
+                line++;
+            }
+
+            if (sscanf(line, matchString.c_str(), &strength) == 1) {
+                break;
+            }
+        }
+
+        if (strength < 0) {
+            if (!ignoreErrors) {
+                out.append("wifi down");
+                print_red(out);
+                endSegment(out, interface);
+            }
+            return false;
+        } else {
+            out.appendf("wifi: %3d%%", strength * 100 / 70);
+
+            if (strength > 30) {
+                print_gray(out);
+            }
+        }
+        return true;
+    }
+
+    const NetModule *net;
+    Nl80211Connection *nl80211;
+    UdevConnection *udevConnection;
+    CachedFile file;
+};
+
+struct MemModule : Module {
+    explicit MemModule(ProcessScanner *scanner) :
+        Module("mem", SelfStats::Mem, 1000),
+        scanner(scanner),
+        file("/proc/meminfo")
+    {
+        adaptive = true;
+    }
+
+    void update(LineBuffer &out) override
+    {
+        print(out);
+        endSegment(out);
+    }
+
+    void print(LineBuffer &out)
+    {
+        const char *meminfo = file.read();
+
+        if (!meminfo) {
+            out.appendf("mem: error reading /proc/meminfo: %s", strerror(errno));
+            return;
+        }
+
+        MemInfo info;
+
+        if (!parse_meminfo(meminfo, &info) || info.total == 0) {
+            out.append("mem: unable to parse /proc/meminfo");
+            return;
+        }
+
+        const long used = info.total - info.available;
+
+        // Includes this one, so it's the same as the current one at first
+        recent.push(used);
+        const long accum = long(recent.mean());
+
+        int percentage = std::round(used * 100.0 / info.total);
+        out.appendf("mem: %3d%%", percentage);
+
+        // Moving more than 64 MB from the average
+        busy = std::abs(used - accum) > 1024 * 64;
+
+        if (percentage > 80 || used - accum > 1024 * 512) {
+            print_top(out);
+            print_red(out);
+        } else {
+            scanner->release(ProcessScanner::Memory);
+
+            if (percentage < 40) {
+                print_gray(out);
+            }
+        }
+    }
+
+    // Who has grown the most, or is the biggest
+    void print_top(LineBuffer &out)
+    {
+        const TopProcess top = g_recorder.capture("procscan", "mem", [&] {
+            return scanner->top(ProcessScanner::Memory, lastRunMs);
+        });
+
+        if (top.name[0]) {
+            out.append(" (");
+            out.appendEscaped(top.name);
+            out.append(")");
+        }
+    }
+
+protected:
+    void resetHistory() override
+    {
+        recent.clear();
+        scanner->release(ProcessScanner::Memory);
+    }
+
+private:
+    ProcessScanner *scanner;
+    CachedFile file;
+    SlidingWindow<long, 1 + mem_samples> recent;
+};
+
+// The date only needs to change once a minute, the clock every second
+struct DateModule : Module {
+    DateModule() :
+        Module("date", SelfStats::Date, 60000)
+    {}
+
+    void update(LineBuffer &out) override
+    {
+        const time_t now = g_recorder.capture("time", "date", [] { return time(nullptr); });
+        tm result;
+
+        char buf[sizeof "week 43 Fri 2015-10-30"];
+        strftime(buf, sizeof buf, "week %V %a %F", localtime_r(&now, &result));
+        out.append(buf);
+        print_gray(out);
+        endSegment(out);
+    }
+};
+
+struct ClockModule : Module {
+    ClockModule() :
+        Module("time", SelfStats::Clock, 1000)
+    {}
+
+    void update(LineBuffer &out) override
+    {
+        g_recorder.value("click", "time", &showSeconds);
+
+        const time_t now = g_recorder.capture("time", "clock", [] { return time(nullptr); });
+        tm result;
+
+        char buf[sizeof "12:44:52"];
+        strftime(buf, sizeof buf, showSeconds ? "%T" : "%R", localtime_r(&now, &result));
+        out.append(buf);
+        endSegment(out);
+    }
+
+    // Click to toggle the seconds
+    bool click(const ClickEvent &event) override
+    {
+        if (event.button != ButtonLeft) {
+            return false;
+        }
+
+        setShowSeconds(!showSeconds);
+        return true;
+    }
+
+    // No point in waking up every second if we don't show them
+    void setShowSeconds(bool show)
+    {
+        showSeconds = show;
+        setInterval(showSeconds ? 1000 : 60000);
+    }
+
+    bool showSeconds = true;
+};
+
+struct VolumeModule : Module {
+    // Changes are pushed to us, so this is just in case
+    explicit VolumeModule(PulseClient *client) :
+        Module("volume", SelfStats::Volume, 10000),
+        client(client)
+    {
+        adaptive = true;
+    }
+
+    void update(LineBuffer &out) override
+    {
+        const VolumeState device = g_recorder.capture("volume", "", [&] {
+            return client->GetDefaultSinkVolume();
+        });
+
+        if (!device.valid) {
+            out.append("couldn't find default sink");
+            print_red(out);
+            endSegment(out);
+            return;
+        }
+
+        out.appendf("vol: %3d%%", device.volume);
+
+        if (device.muted) {
+            print_gray(out);
+        } else {
+            print_green(out);
+        }
+
+        endSegment(out);
+    }
+
+    // Click to mute, scroll to change the volume. The client updates what
+    // it has right away, so we can show it without waiting for pulse.
+    bool click(const ClickEvent &event) override
+    {
+        switch (event.button) {
+        case ButtonLeft:
+            return client->ToggleMute();
+
+        case ScrollUp:
+            return client->ChangeVolume(volumeStep);
+
+        case ScrollDown:
+            return client->ChangeVolume(-volumeStep);
+
+        default:
+            return false;
+        }
+    }
+
+    static constexpr int volumeStep = 5;
+
+    PulseClient *client;
+};
+
+#ifdef ENABLE_NOTIFICATIONS
+struct NotificationModule : Module {
+    // Invalidated every second while there's something to show, so it can
+    // flash without making us wake up every second for nothing
+    NotificationModule() :
+        Module("notification", SelfStats::Notification, 60000)
+    {}
+
+    void update(LineBuffer &out) override
+    {
+        // The whole thing is recorded, id 0 means nothing was showing
+        const Notification shown = g_recorder.capture("notification", "", [] {
+            return g_notifications.empty() ? Notification() : g_notifications.front();
+        });
+
+        if (shown.id) {
+            print_notification(out, shown, lastRunMs);
+            endSegment(out);
+        }
+    }
+
+    // Left click opens it if the sender can, right click just dismisses it
+    bool click(const ClickEvent &event) override
+    {
+        if ((event.button != ButtonLeft && event.button != ButtonRight) || g_notifications.empty()) {
+            return false;
+        }
+
+        const Notification &notification = g_notifications.front();
+
+        if (event.button == ButtonLeft && notification.hasDefaultAction) {
+            emit_action_invoked(notification.id, "default");
+        }
+
+        emit_notification_closed(g_notifications.popFront(), NotificationDismissed);
+        return true;
+    }
+};
+#endif
+
+// Debug segment, how long a frame takes to put together and write out
+struct StatsModule : Module {
+    StatsModule() :
+        Module("stats", SelfStats::Debug, 1000)
+    {}
+
+    void update(LineBuffer &out) override
+    {
+        const LatencyHistogram &frame = g_stats.histograms[SelfStats::Frame];
+        const LatencyHistogram &write = g_stats.histograms[SelfStats::Write];
+
+        out.appendf("frame: p50 %.0fus p99 %.0fus max %.0fus, write p99 %.0fus, %.0f wakeups/min",
+                    frame.percentile(50) / 1000.0, frame.percentile(99) / 1000.0, frame.max / 1000.0,
+                    write.percentile(99) / 1000.0, g_stats.wakeupsPerMinute());
+        print_gray(out);
+        endSegment(out);
+    }
+};
+
+struct Status
+{
+    Status() :
+        client("status"),
+        battery(&udevConnection, &userBus, &systemBus),
+        disks(&mountWatcher, &diskProber),
+        diskio(&mountWatcher),
+        cpu(&processScanner),
+        load(&cpu),
+        net(&rtnetlink, &udevConnection),
+        wifi(&net, &nl80211, &udevConnection),
+        mem(&processScanner),
+        volume(&client)
+    {}
+
+    // Everything we have, in the default order
+    std::vector<Module *> allModules()
+    {
+        return {
+            &stats,
+#ifdef ENABLE_NOTIFICATIONS
+            &notification,
+#endif
+            &battery,
+            &disks,
+            &diskio,
+            &net,
+            &wifi,
+            &load,
+            &pressure,
+            &mem,
+            &cpu,
+            &volume,
+            &date,
+            &clock,
+        };
+    }
+
+    Module *findModule(std::string_view name)
+    {
+        for (Module *module : allModules()) {
+            if (name == module->name) {
+                return module;
+            }
+        }
+
+        return nullptr;
+    }
+
+    // "disks=30", seconds
+    bool setInterval(std::string_view setting)
+    {
+        const size_t equals = setting.find('=');
+        Module *module = findModule(setting.substr(0, equals));
+
+        if (equals == std::string_view::npos || !module) {
+            fprintf(stderr, "Invalid interval '%.*s', should be e. g. disks=30\n", int(setting.size()), setting.data());
+            return false;
+        }
+
+        module->setInterval(unsigned(atof(std::string(setting.substr(equals + 1)).c_str()) * 1000));
+        return true;
+    }
+
+    // Only update once a minute, and don't write anything if nothing changed
+    void hideSeconds()
+    {
+        clock.setShowSeconds(false);
+        skipIdentical = true;
+    }
+
+    // Comma separated names, or the default if empty
+    void arrangeModules(std::string_view order)
+    {
+        modules.clear();
+        layoutChanged = true;
+
+        if (order.empty()) {
+            for (Module *module : allModules()) {
+                if ((module == &stats && !showStats) || (module == &wifi && ignoreWifi)) {
+                    continue;
+                }
+
+                modules.push_back(module);
+            }
+
+            return;
+        }
+
+        while (!order.empty()) {
+            const size_t comma = order.find(',');
+            const std::string_view name = order.substr(0, comma);
+
+            if (Module *module = findModule(name)) {
+                modules.push_back(module);
+            } else if (!name.empty()) {
+                fprintf(stderr, "Unknown module '%.*s'\n", int(name.size()), name.data());
+            }
+
+            if (comma == std::string_view::npos) {
+                break;
+            }
+
+            order.remove_prefix(comma + 1);
+        }
+    }
+
+    void init()
+    {
+        // Things that don't change while we're running
+        cpu.count = g_recorder.capture("setup", "cpus", [] { return unsigned(get_nprocs()); });
+        g_recorder.strings("setup", "ethernet", &udevConnection.ethernetInterfaces);
+        g_recorder.strings("setup", "wlan", &udevConnection.wlanInterfaces);
+
+        // Everything comes from the recording
+        if (g_recorder.replaying()) {
+            return;
+        }
+
+        eventLoop.add(mountWatcher.fd, EPOLLPRI, [this](uint32_t) {
+            mountWatcher.changed = true;
+            disks.invalidate();
+            diskio.invalidate();
+            needsRedraw = true;
+        });
+
+        eventLoop.add(udevConnection.udevSocketFd, EPOLLIN, [this](uint32_t) {
+            udevConnection.update(true);
+            battery.invalidate();
+            needsRedraw = true;
+        });
+
+        eventLoop.add(rtnetlink.monitorFd, EPOLLIN, [this](uint32_t) {
+            net.processMonitor();
+            wifi.invalidate();
+            needsRedraw = true;
+        });
+
+        // Memory and io stalls wake us up, but only for the real /proc and
+        // if anyone is going to see it
+        if (g_rootPrefix.empty() && std::find(modules.begin(), modules.end(), &pressure) != modules.end()) {
+            pressure.armTriggers();
+
+            for (int i = PressureModule::Memory; i < PressureModule::ResourceCount; i++) {
+                eventLoop.add(pressure.triggers[i].fd, EPOLLPRI, [this, i](uint32_t) {
+                    pressure.stalled[i] = true;
+                    pressure.invalidate();
+                    needsRedraw = true;
+                });
+            }
+        }
+
+        // Stop collecting while locked, idle or asleep, and where we power
+        // off from
+        if (systemBus.open(true)) {
+            // Might have gotten something while connecting
+            if (logind.connect(systemBus.bus)) {
+                processLogind();
+            }
+
+            watchBus(&systemBus, [this] {
+                processLogind();
+            });
+        }
+
+        // i3bar writes clicks to our stdin, but don't bother if it's e. g.
+        // /dev/null because we're not running under it
+        struct stat input;
+
+        if (fstat(STDIN_FILENO, &input) == 0 && (S_ISFIFO(input.st_mode) || S_ISSOCK(input.st_mode) || isatty(STDIN_FILENO))) {
+            readingClicks = eventLoop.add(STDIN_FILENO, EPOLLIN, [this](uint32_t) {
+                readClicks();
+            });
+        }
+
+        // Volume changes get pushed to us, so redraw right away. Even if it
+        // can't connect yet, it tries again and tells us the same way.
+        client.Connect();
+
+        eventLoop.add(client.EventFd(), EPOLLIN, [this](uint32_t) {
+            client.ProcessEvents();
+            volume.invalidate();
+            needsRedraw = true;
+        });
+
+        // For sending notifications, and getting them if we show them
+        if (userBus.open(false)) {
+#ifdef ENABLE_NOTIFICATIONS
+            if (!register_notification_service(userBus.bus, &slot)) {
+                fprintf(stderr, "Not using notifications\n");
+            }
+#endif
+
+            watchBus(&userBus, [this] {
+                userBus.process();
+
+#ifdef ENABLE_NOTIFICATIONS
+                notification.invalidate();
+                needsRedraw = true;
+#endif
+            });
+        }
+    }
+
+    void watchBus(BusConnection *bus, std::function<void()> handler)
+    {
+        bus->watching = bus->events();
+
+        eventLoop.add(bus->fd, bus->watching, [this, bus, handler](uint32_t) {
+            handler();
+            updateBusEvents(bus);
+        });
+    }
+
+    // Only wait for it to be writable while something is queued, like a
+    // call that's made before it's done connecting
+    void updateBusEvents(BusConnection *bus)
+    {
+        const uint32_t events = bus->events();
+
+        if (bus->fd < 0 || events == bus->watching) {
+            return;
+        }
+
+        if (eventLoop.modify(bus->fd, events)) {
+            bus->watching = events;
+        }
+    }
+
+    void processLogind()
+    {
+        const bool wasPaused = logind.paused();
+        systemBus.process();
+
+        if (logind.paused() == wasPaused) {
+            return;
+        }
+
+        // Anything averaged would cover the whole time we were away
+        if (!logind.paused()) {
+            resumed = true;
+        }
+
+        needsRedraw = true;
+    }
+
+    // Only the battery watchdog runs while we're paused
+    bool isRunning(const Module *module) const
+    {
+        return !paused || module == &battery;
+    }
+
+    void readClicks()
+    {
+        const bool open = clickReader.read(STDIN_FILENO, [this](const ClickEvent &event) {
+            for (Module *module : modules) {
+                if (event.name == module->name && module->click(event)) {
+                    module->invalidate();
+                    needsRedraw = true;
+                }
+            }
+        });
+
+        // Can't remove it from inside its own handler
+        if (!open) {
+            readingClicks = false;
+        }
+    }
+
+    bool print()
+    {
+        bool changed;
+
+        {
+            PhaseTimer timer(SelfStats::Frame);
+            changed = render();
+        }
+
+        if (!changed && skipIdentical) {
+            g_stats.skippedFrames++;
+            return true;
+        }
+
+        PhaseTimer timer(SelfStats::Write);
+        return line.write(outputFd);
+    }
+
+    // Runs the modules that are due, and puts the line together again if
+    // any of them printed something different. Returns false if the line is
+    // the same as last time.
+    bool render()
+    {
+        g_recorder.beginFrame();
+        g_recorder.value("mounts", "changed", &mountWatcher.changed);
+
+        const uint64_t now = g_recorder.capture("time", "frame", realtime_ms);
+
+        paused = logind.paused();
+        g_recorder.value("session", "paused", &paused);
+        g_recorder.value("session", "resumed", &resumed);
+
+        // udev tells us when something changes, this is in case it didn't,
+        // like while we were suspended
+        if (!g_recorder.replaying() && (resumed || now - lastPowerReadMs >= powerRereadMs)) {
+            udevConnection.rereadPower();
+            lastPowerReadMs = now;
+            battery.invalidate();
+        }
+
+        g_recorder.value("power", "valid", &udevConnection.power.valid);
+        g_recorder.value("power", "charger", &udevConnection.power.chargerOnline);
+        g_recorder.value("power", "percentage", &udevConnection.power.percentage);
+        g_recorder.value("power", "energy", &udevConnection.power.energy);
+
+        if (resumed) {
+            for (Module *module : allModules()) {
+                module->reset();
+            }
+
+            resumed = false;
+        }
+
+        applyCadence(now);
+
+        bool changed = layoutChanged;
+        layoutChanged = false;
+
+        for (Module *module : modules) {
+            // Clicks can change the intervals too, so record what was run
+            // rather than why
+            bool due = isRunning(module) && module->due(now);
+            g_recorder.value("due", module->name, &due);
+
+            if (due) {
+                module->run(now);
+                changed = module->changed || changed;
+            }
+        }
+
+        g_recorder.endFrame();
+
+        // In case the battery sent something
+        updateBusEvents(&userBus);
+        updateBusEvents(&systemBus);
+
+        if (!changed) {
+            return false;
+        }
+
+        line.clear();
+        line.append(" [ { \"full_text\": \"");
+
+        for (const Module *module : modules) {
+            line.append(module->output.view());
+        }
+
+        // Every segment ends with a separator, so drop the last one
+        line.removeSuffix(segment_separator);
+
+        line.append("\" } ],\n");
+
+        return true;
+    }
+
+    // Slows down the modules that only sample something when we're on
+    // battery or nothing is happening, and drops the seconds on battery
+    // since that's what makes us wake up every second.
+    void applyCadence(uint64_t now)
+    {
+        const bool onBattery = udevConnection.power.valid && !udevConnection.power.chargerOnline;
+        bool busy = false;
+
+        for (const Module *module : modules) {
+            busy = busy || module->busy;
+        }
+
+        const unsigned factor = cadence.update(now, onBattery, busy);
+
+        for (Module *module : modules) {
+            if (module->adaptive) {
+                module->setScale(factor);
+            }
+        }
+
+        if (!batteryNoSeconds || onBattery == wasOnBattery) {
+            return;
+        }
+
+        // Only when asked to, put back whatever it was when we're plugged in
+        // again
+        if (onBattery) {
+            secondsOnAc = clock.showSeconds;
+            skipIdenticalOnAc = skipIdentical;
+            hideSeconds();
+        } else {
+            clock.setShowSeconds(secondsOnAc);
+            skipIdentical = skipIdenticalOnAc;
+        }
+
+        wasOnBattery = onBattery;
+    }
+
+    // Waits until the next module is due or for an udev event (or dbus event
+    // in case notifications is enabled), returns false on fatal errors.
+    bool wait()
+    {
+        PhaseTimer timer(SelfStats::Wait);
+
+        needsRedraw = false;
+
+        while (!needsRedraw && g_running) {
+            bool ticked = false;
+
+            if (!eventLoop.wait(&ticked, scheduleWakeup())) {
+                return false;
+            }
+
+            // i3bar went away, or stdin was closed
+            if (!readingClicks) {
+                eventLoop.remove(STDIN_FILENO);
+            }
+
+            if (g_dumpStats) {
+                g_dumpStats = false;
+                g_stats.dump(stderr);
+            }
+
+            // Nothing came in, but a call timed out and its reply handler
+            // should hear about it
+            if (systemBus.timeoutMs() == 0) {
+                processLogind();
+                updateBusEvents(&systemBus);
+            }
+
+            if (userBus.timeoutMs() == 0) {
+                userBus.process();
+                updateBusEvents(&userBus);
+            }
+
+            if (!ticked) {
+                continue;
+            }
+
+#ifdef ENABLE_NOTIFICATIONS
+            if (!g_notifications.empty()) {
+                const uint64_t now = realtime_ms();
+
+                while (!g_notifications.empty() && g_notifications.front().expiresMs <= now) {
+                    emit_notification_closed(g_notifications.popFront(), NotificationExpired);
+                }
+
+                notification.invalidate();
+            }
+#endif
+
+            needsRedraw = true;
+        }
+
+        return true;
+    }
+
+    // Arms the timer for the next module that needs to be on time, like the
+    // clock, and returns the epoll timeout for the ones that can be a bit
+    // late, so the timer slack applies to them.
+    int scheduleWakeup()
+    {
+        const uint64_t now = realtime_ms();
+        uint64_t exact = UINT64_MAX;
+        uint64_t sampled = UINT64_MAX;
+
+        for (const Module *module : modules) {
+            if (!isRunning(module)) {
+                continue;
+            }
+
+            uint64_t &next = module->adaptive ? sampled : exact;
+            next = std::min(next, module->nextDue(now));
+        }
+
+#ifdef ENABLE_NOTIFICATIONS
+        // Flashes every second, and goes away on time
+        if (!g_notifications.empty()) {
+            exact = std::min({ exact, (now / 1000 + 1) * 1000, g_notifications.front().expiresMs });
+        }
+#endif
+
+        if (exact != UINT64_MAX) {
+            eventLoop.scheduleTick(exact);
+        }
+
+        int timeout = -1;
+
+        // The timer gets those anyways. Otherwise a millisecond extra so we
+        // don't wake up just before it's due.
+        if (sampled < exact) {
+            timeout = int(std::min<uint64_t>(sampled > now ? sampled - now + 1 : 1, INT_MAX));
+        }
+
+        // Calls that don't get answered time out, and need us to notice
+        for (const BusConnection *bus : { &systemBus, &userBus }) {
+            const int busTimeout = bus->timeoutMs();
+
+            if (busTimeout >= 0 && (timeout < 0 || busTimeout < timeout)) {
+                timeout = busTimeout;
+            }
+        }
+
+        return timeout;
+    }
+
+    ~Status()
+    {
+        const EventLoop::TimerStats &stats = eventLoop.timerStats;
+
+        if (stats.ticks > 0) {
+            fprintf(stderr, "timer: %lu ticks, %lu missed, jitter avg %ld us, max %ld us\n",
+                    (unsigned long)stats.ticks, (unsigned long)stats.missed,
+                    long(stats.totalJitterNs / int64_t(stats.ticks) / 1000), long(stats.maxJitterNs / 1000));
+        }
+
+#ifdef ENABLE_NOTIFICATIONS
+        if (slot) {
+            sd_bus_slot_unref(slot);
+        }
+#endif
+    }
+
+    bool ignoreWifi = false;
+    bool showStats = false;
+    bool skipIdentical = false;
+
+    // Kept open, so sending something never waits for a connection
+    BusConnection systemBus;
+    BusConnection userBus;
+
+    LogindWatcher logind;
+    bool paused = false;
+    bool resumed = false;
+
+    // Safety net for missed udev events
+    static constexpr uint64_t powerRereadMs = 60000;
+    uint64_t lastPowerReadMs = 0;
+
+    Cadence cadence;
+    bool batteryNoSeconds = false;
+    bool wasOnBattery = false;
+    bool secondsOnAc = true;
+    bool skipIdenticalOnAc = false;
+    int outputFd = STDOUT_FILENO;
+
+    MountWatcher mountWatcher;
+    DiskProber diskProber;
+    ProcessScanner processScanner;
+
+    EventLoop eventLoop;
+    bool needsRedraw = false;
+
+    ClickReader clickReader;
+    bool readingClicks = false;
+
+    UdevConnection udevConnection;
+    RtnetlinkConnection rtnetlink;
+    Nl80211Connection nl80211;
+
+    PulseClient client;
 
 #ifdef ENABLE_NOTIFICATIONS
     sd_bus_slot *slot = nullptr;
-    sd_bus *bus = nullptr;
+
+    NotificationModule notification;
 #endif
+
+    StatsModule stats;
+    BatteryModule battery;
+    DisksModule disks;
+    DiskIoModule diskio;
+    CpuModule cpu;
+    LoadModule load;
+    PressureModule pressure;
+    NetModule net;
+    WifiModule wifi;
+    MemModule mem;
+    VolumeModule volume;
+    DateModule date;
+    ClockModule clock;
+
+    // The ones we show, in order
+    std::vector<Module *> modules;
+
+    // The line as of the last frame, only put together again if a module
+    // printed something different or the modules were rearranged
+    LineBuffer line;
+    bool layoutChanged = true;
 };
 
+// The benchmarks include this file to get at everything
+#ifndef STATUS_BENCH
+static long long monotonic_ns()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Runs through a recording, either with the original timing or as fast as
+// possible, which makes it a benchmark of everything except the I/O.
+static bool replay(Status &status, bool realtime)
+{
+    const long long start = monotonic_ns();
+    int64_t firstFrame = -1;
+    int64_t timestamp = 0;
+    unsigned long frames = 0;
+
+    while (g_running && g_recorder.nextFrame(&timestamp)) {
+        if (firstFrame < 0) {
+            firstFrame = timestamp;
+        }
+
+        if (realtime) {
+            const long long delay = start + (timestamp - firstFrame) - monotonic_ns();
+
+            if (delay > 0) {
+                const timespec ts = { time_t(delay / 1000000000LL), long(delay % 1000000000LL) };
+                nanosleep(&ts, nullptr);
+            }
+        }
+
+        if (!status.print()) {
+            return false;
+        }
+
+        frames++;
+
+        if (g_dumpStats) {
+            g_dumpStats = false;
+            g_stats.dump(stderr);
+        }
+    }
+
+    const double elapsed = (monotonic_ns() - start) / 1000000000.0;
+    fprintf(stderr, "replay: %lu frames in %.3f s, %.0f frames/s\n", frames, elapsed, frames / elapsed);
+
+    if (!realtime) {
+        g_stats.dump(stderr);
+    }
+
+    return true;
+}
+
 int main(int argc, char *argv[])
 {
+    bool replaying = false;
+    bool realtime = true;
+
+    // Needs to be set before anything opens files
+    for (int i = 1; i < argc - 1; i++) {
+        if (strcmp(argv[i], "--root") == 0) {
+            g_rootPrefix = argv[i + 1];
+        } else if (strcmp(argv[i], "--record") == 0) {
+            if (!g_recorder.startRecording(argv[i + 1])) {
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--replay") == 0 || strcmp(argv[i], "--replay-fast") == 0) {
+            if (!g_recorder.startReplay(argv[i + 1])) {
+                return 1;
+            }
+
+            replaying = true;
+            realtime = strcmp(argv[i], "--replay") == 0;
+        }
+    }
+
+    // Before anything starts a thread, so they get it too
+    set_timer_slack(timerSlackNs);
+
     Status status;
+    std::string_view order;
 
     for (int i = 1; i < argc; i++) {
-        if (strcmp(argv[i], "--ignore-wifi") == 0) {
+        if ((strcmp(argv[i], "--root") == 0 || strcmp(argv[i], "--record") == 0 ||
+                strcmp(argv[i], "--replay") == 0 || strcmp(argv[i], "--replay-fast") == 0) && i + 1 < argc) {
+            i++;
+        } else if (strcmp(argv[i], "--ignore-wifi") == 0) {
             status.ignoreWifi = true;
+        } else if (strcmp(argv[i], "--debug-stats") == 0) {
+            status.showStats = true;
+        } else if (strcmp(argv[i], "--no-seconds") == 0) {
+            status.hideSeconds();
+        } else if (strcmp(argv[i], "--no-adaptive") == 0) {
+            status.cadence.enabled = false;
+        } else if (strcmp(argv[i], "--battery-no-seconds") == 0) {
+            status.batteryNoSeconds = true;
+        } else if (strcmp(argv[i], "--fs-types") == 0 && i + 1 < argc) {
+            status.mountWatcher.setFilesystemTypes(argv[++i]);
+        } else if (strcmp(argv[i], "--disk-interval") == 0 && i + 1 < argc) {
+            status.diskProber.interval = std::chrono::seconds(std::max(atoi(argv[++i]), 1));
+        } else if (strcmp(argv[i], "--order") == 0 && i + 1 < argc) {
+            order = argv[++i];
+        } else if (strcmp(argv[i], "--interval") == 0 && i + 1 < argc) {
+            if (!status.setInterval(argv[++i])) {
+                return 1;
+            }
         }
     }
+    status.arrangeModules(order);
     status.init();
 
     struct sigaction sa = {};
@@ -748,13 +2209,32 @@ int main(int argc, char *argv[])
     };
     sigaction(SIGINT, &sa, nullptr);
 
-    printf("{ \"version\": 1 }\n[\n");
+    sa.sa_handler = [](int) {
+        g_dumpStats = true;
+    };
+    sigaction(SIGUSR1, &sa, nullptr);
+
+    LineBuffer header;
+    header.append("{ \"version\": 1, \"click_events\": true }\n[\n");
+
+    if (!header.flush(STDOUT_FILENO)) {
+        return 1;
+    }
+
+    if (replaying) {
+        return replay(status, realtime) ? 0 : 1;
+    }
+
+    if (!status.eventLoop.valid) {
+        return 1;
+    }
 
     while (g_running) {
-        if (!status.print()) {
+        if (!status.print() || !status.wait()) {
             break;
         }
     }
 
     return 0;
 }
+#endif // STATUS_BENCH
@@ -0,0 +1,162 @@
+#pragma once
+
+#include "clickevents.h"
+#include "json_helpers.h"
+#include "stats.h"
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <utility>
+
+// Something in the bar with its own state and refresh interval. It renders
+// its segments into its own buffer, each one finished with endSegment(), and
+// the line is put together from those, so the ones that aren't due just get
+// their last output reused.
+struct Module {
+    Module(const char *name, SelfStats::Phase phase, unsigned intervalMs) :
+        name(name),
+        phase(phase),
+        intervalMs(intervalMs)
+    {}
+
+    virtual ~Module() = default;
+
+    Module(const Module &) = delete;
+    Module &operator=(const Module &) = delete;
+
+    // Due when the wall clock crosses into a new interval, so e. g. something
+    // that updates every minute does it right when the minute changes, and
+    // everything with the same interval updates in the same frame.
+    bool due(uint64_t nowMs) const
+    {
+        return dirty || nowMs / interval() != lastRunMs / interval();
+    }
+
+    // When it'll be due next, if nothing else happens. Dirty ones run on the
+    // next second like before, so a module that keeps itself dirty doesn't
+    // make us spin.
+    uint64_t nextDue(uint64_t nowMs) const
+    {
+        if (dirty) {
+            return (nowMs / 1000 + 1) * 1000;
+        }
+
+        return (nowMs / interval() + 1) * interval();
+    }
+
+    void run(uint64_t nowMs)
+    {
+        PhaseTimer timer(phase);
+
+        // The wall clock was set back (NTP, or by hand), so everything we
+        // have is from the future and the time since the last run would
+        // wrap around. Start over like after a suspend.
+        if (nowMs < lastRunMs) {
+            lastRunMs = 0;
+            resetHistory();
+        }
+
+        elapsedMs = lastRunMs ? nowMs - lastRunMs : 0;
+        lastRunMs = nowMs;
+        dirty = false;
+        busy = false;
+
+        // Keep the last one around to see if anything actually changed
+        std::swap(output, previous);
+        output.clear();
+        update(output);
+
+        changed = output.view() != previous.view();
+    }
+
+    // Makes it run next frame even if it isn't due, when we know something
+    // it shows has changed.
+    void invalidate()
+    {
+        dirty = true;
+    }
+
+    // Called when one of our segments is clicked, returns true if that
+    // changed something, so we run again and the bar is redrawn right away.
+    virtual bool click(const ClickEvent &)
+    {
+        return false;
+    }
+
+    void setInterval(unsigned ms)
+    {
+        intervalMs = std::max(ms, 1u);
+        dirty = true;
+    }
+
+    // Forget everything that's averaged over time, e. g. after a suspend,
+    // when the next sample would cover all the time we were asleep.
+    void reset()
+    {
+        lastRunMs = 0;
+        elapsedMs = 0;
+        dirty = true;
+        resetHistory();
+    }
+
+    // For slowing down with the cadence, on top of the configured interval
+    void setScale(unsigned factor)
+    {
+        scale = std::max(factor, 1u);
+    }
+
+    unsigned interval() const
+    {
+        return intervalMs * scale;
+    }
+
+    const char *const name;
+    const SelfStats::Phase phase;
+
+    // Set by events, or by the module itself if it wants to run again
+    bool dirty = true;
+
+    // If the output is different after the last run
+    bool changed = true;
+
+    // Only samples something, so it's fine to run it less often when we're
+    // saving power
+    bool adaptive = false;
+
+    // Set by the module when what it shows is moving quickly, which puts
+    // everything back to the normal rate for a while
+    bool busy = false;
+
+    LineBuffer output;
+
+protected:
+    virtual void update(LineBuffer &out) = 0;
+
+    virtual void resetHistory() {}
+
+    // Tags the segment so clicks on it come back to us, with the instance
+    // telling apart e. g. the different interfaces.
+    void endSegment(LineBuffer &out, std::string_view instance = {}) const
+    {
+        out.append("\", \"name\": \"");
+        out.append(name);
+
+        if (!instance.empty()) {
+            out.append("\", \"instance\": \"");
+            out.appendEscaped(instance);
+        }
+
+        print_sep(out);
+    }
+
+    // Wall clock time of the current run, and how long since the last one
+    uint64_t lastRunMs = 0;
+    uint64_t elapsedMs = 0;
+
+private:
+    unsigned intervalMs;
+    unsigned scale = 1;
+
+    LineBuffer previous;
+};
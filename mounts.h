@@ -0,0 +1,226 @@
+#pragma once
+
+#include "filecache.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/sysmacros.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <charconv>
+#include <string>
+#include <string_view>
+#include <vector>
+
+struct Mount {
+    std::string path;
+    std::string source;
+    std::string type;
+    dev_t device = 0;
+};
+
+// Keeps track of the filesystems we want to show. The kernel flags the
+// mount table with POLLPRI when it changes, so we only re-parse it then
+// instead of every time something looks off.
+struct MountWatcher {
+    MountWatcher() :
+        file("/proc/self/mountinfo")
+    {
+        fd = open(rooted_path(file.path).c_str(), O_RDONLY | O_CLOEXEC);
+
+        if (fd < 0) {
+            fprintf(stderr, "Failed to open %s for watching: %s\n", file.path.c_str(), strerror(errno));
+        }
+    }
+
+    ~MountWatcher()
+    {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    MountWatcher(const MountWatcher &) = delete;
+    MountWatcher &operator=(const MountWatcher &) = delete;
+
+    // Comma separated, e. g. "ext4,btrfs,xfs"
+    void setFilesystemTypes(std::string_view types)
+    {
+        filesystemTypes.clear();
+
+        while (!types.empty()) {
+            const size_t comma = types.find(',');
+            const std::string_view type = types.substr(0, comma);
+
+            if (!type.empty()) {
+                filesystemTypes.emplace_back(type);
+            }
+
+            if (comma == std::string_view::npos) {
+                break;
+            }
+
+            types.remove_prefix(comma + 1);
+        }
+
+        changed = true;
+    }
+
+    // Re-parses the mount table if it has changed, returns true if it did.
+    bool update()
+    {
+        if (!changed) {
+            return false;
+        }
+
+        changed = false;
+
+        const char *mountinfo = file.read();
+
+        if (!mountinfo) {
+            fprintf(stderr, "Failed to read %s: %s\n", file.path.c_str(), strerror(errno));
+            return false;
+        }
+
+        std::vector<Mount> newMounts;
+
+        for (const char *line = mountinfo; line && *line;) {
+            const char *end = strchr(line, '\n');
+            const std::string_view entry(line, end ? end - line : strlen(line));
+            line = end ? end + 1 : nullptr;
+
+            Mount mount;
+
+            if (!parseEntry(entry, &mount)) {
+                continue;
+            }
+
+            // Bind mounts and btrfs subvolumes show up several times
+            bool duplicate = false;
+
+            for (const Mount &existing : newMounts) {
+                if (existing.device == mount.device) {
+                    duplicate = true;
+                    break;
+                }
+            }
+
+            if (!duplicate) {
+                newMounts.push_back(std::move(mount));
+            }
+        }
+
+        mounts = std::move(newMounts);
+        generation++;
+        return true;
+    }
+
+    // Poll this for EPOLLPRI
+    int fd = -1;
+
+    bool changed = true;
+    std::vector<Mount> mounts;
+
+    // Goes up each time the mounts are re-parsed, so more than one module
+    // can tell it happened
+    unsigned generation = 0;
+
+private:
+    bool wantedType(std::string_view type) const
+    {
+        for (const std::string &wanted : filesystemTypes) {
+            if (wanted == type) {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    // Spaces and such are escaped as octal, e. g. \040
+    static std::string unescape(std::string_view escaped)
+    {
+        std::string result;
+        result.reserve(escaped.size());
+
+        for (size_t i = 0; i < escaped.size(); i++) {
+            if (escaped[i] == '\\' && i + 3 < escaped.size() &&
+                    escaped[i + 1] >= '0' && escaped[i + 1] <= '7') {
+                result += char((escaped[i + 1] - '0') * 64 + (escaped[i + 2] - '0') * 8 + (escaped[i + 3] - '0'));
+                i += 3;
+            } else {
+                result += escaped[i];
+            }
+        }
+
+        return result;
+    }
+
+    static std::string_view nextField(std::string_view *line)
+    {
+        const size_t start = line->find_first_not_of(' ');
+
+        if (start == std::string_view::npos) {
+            *line = {};
+            return {};
+        }
+
+        line->remove_prefix(start);
+        const size_t end = line->find(' ');
+        const std::string_view field = line->substr(0, end);
+        line->remove_prefix(end == std::string_view::npos ? line->size() : end);
+        return field;
+    }
+
+    // 36 35 98:0 /mnt1 /mnt/parent rw,noatime master:1 - ext3 /dev/root rw,errors=continue
+    // Returns false for malformed lines and types we don't care about
+    bool parseEntry(std::string_view line, Mount *mount) const
+    {
+        nextField(&line); // mount id
+        nextField(&line); // parent id
+
+        const std::string_view device = nextField(&line);
+        const size_t colon = device.find(':');
+        unsigned major = 0, minor = 0;
+
+        if (colon == std::string_view::npos ||
+                std::from_chars(device.data(), device.data() + colon, major).ec != std::errc() ||
+                std::from_chars(device.data() + colon + 1, device.data() + device.size(), minor).ec != std::errc()) {
+            return false;
+        }
+
+        nextField(&line); // root
+        const std::string_view path = nextField(&line);
+        nextField(&line); // options
+
+        // Optional fields until the separator
+        std::string_view field;
+
+        do {
+            field = nextField(&line);
+        } while (!field.empty() && field != "-");
+
+        if (field.empty()) {
+            return false;
+        }
+
+        // Check before allocating anything, there might be thousands
+        const std::string_view type = nextField(&line);
+
+        if (!wantedType(type)) {
+            return false;
+        }
+
+        mount->type = std::string(type);
+        mount->source = unescape(nextField(&line));
+        mount->path = unescape(path);
+        mount->device = makedev(major, minor);
+
+        return !mount->path.empty();
+    }
+
+    CachedFile file;
+    std::vector<std::string> filesystemTypes = { "ext4", "btrfs", "xfs", "zfs" };
+};
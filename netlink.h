@@ -0,0 +1,590 @@
+#pragma once
+
+#include "procparsers.h"
+#include "stats.h"
+
+#include <errno.h>
+#include <net/if.h> // needs to come before linux/if.h
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <linux/genetlink.h>
+#include <linux/if.h>
+#include <linux/if_link.h>
+#include <linux/netlink.h>
+#include <linux/nl80211.h>
+#include <linux/rtnetlink.h>
+
+#include <algorithm>
+#include <string_view>
+#include <vector>
+
+// recv() for netlink, where a message that doesn't fit is cut off without
+// saying so unless we ask with MSG_TRUNC. The rest of it is gone then, so
+// the buffer is made big enough for the next time and it fails with
+// EMSGSIZE, instead of parsing half a message.
+inline ssize_t receive_netlink(int fd, std::vector<char> *buffer)
+{
+    const ssize_t length = recv(fd, buffer->data(), buffer->size(), MSG_TRUNC);
+
+    if (length > ssize_t(buffer->size())) {
+        buffer->resize(length);
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    return length;
+}
+
+struct LinkState {
+    int index = 0;
+    NetDevCounters counters;
+    bool haveCounters = false; // not always in change notifications
+    bool up = false; // has carrier and operstate is up (or unknown, for drivers that don't set it)
+};
+
+// Gets the counters and operstate for all interfaces with one RTM_GETLINK
+// dump, and listens for link changes so we notice carrier changes right away.
+struct RtnetlinkConnection {
+    RtnetlinkConnection()
+    {
+        requestFd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+
+        if (requestFd < 0) {
+            fprintf(stderr, "Failed to open rtnetlink socket: %s\n", strerror(errno));
+            return;
+        }
+
+        monitorFd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_ROUTE);
+
+        if (monitorFd < 0) {
+            fprintf(stderr, "Failed to open rtnetlink monitor socket: %s\n", strerror(errno));
+        } else {
+            sockaddr_nl address = {};
+            address.nl_family = AF_NETLINK;
+            address.nl_groups = RTMGRP_LINK;
+
+            if (bind(monitorFd, reinterpret_cast<sockaddr *>(&address), sizeof address) < 0) {
+                fprintf(stderr, "Failed to listen for link changes: %s\n", strerror(errno));
+                close(monitorFd);
+                monitorFd = -1;
+            }
+        }
+
+        buffer.resize(bufferSize);
+        available = true;
+    }
+
+    ~RtnetlinkConnection()
+    {
+        if (requestFd >= 0) {
+            close(requestFd);
+        }
+
+        if (monitorFd >= 0) {
+            close(monitorFd);
+        }
+    }
+
+    RtnetlinkConnection(const RtnetlinkConnection &) = delete;
+    RtnetlinkConnection &operator=(const RtnetlinkConnection &) = delete;
+
+    // Calls callback(std::string_view name, const LinkState &) for every
+    // interface, returns false if the dump failed.
+    template<typename Callback>
+    bool dumpLinks(Callback &&callback)
+    {
+        if (!available) {
+            return false;
+        }
+
+        struct {
+            nlmsghdr header;
+            ifinfomsg info;
+        } request = {};
+
+        request.header.nlmsg_len = sizeof request;
+        request.header.nlmsg_type = RTM_GETLINK;
+        request.header.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+        request.header.nlmsg_seq = ++sequence;
+        request.info.ifi_family = AF_UNSPEC;
+
+        g_stats.netlinkCalls++;
+
+        if (send(requestFd, &request, sizeof request, 0) < 0) {
+            fprintf(stderr, "Failed to request links: %s\n", strerror(errno));
+            return false;
+        }
+
+        while (true) {
+            g_stats.netlinkCalls++;
+            const ssize_t length = receive_netlink(requestFd, &buffer);
+
+            if (length < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+
+                fprintf(stderr, "Failed to receive links: %s\n", strerror(errno));
+                return false;
+            }
+
+            int remaining = length;
+
+            for (const nlmsghdr *header = reinterpret_cast<const nlmsghdr *>(buffer.data());
+                    NLMSG_OK(header, remaining); header = NLMSG_NEXT(header, remaining)) {
+                if (header->nlmsg_seq != sequence) {
+                    continue;
+                }
+
+                if (header->nlmsg_type == NLMSG_DONE) {
+                    return true;
+                }
+
+                if (header->nlmsg_type == NLMSG_ERROR) {
+                    const nlmsgerr *error = static_cast<const nlmsgerr *>(NLMSG_DATA(header));
+                    fprintf(stderr, "Link dump failed: %s\n", strerror(-error->error));
+                    return false;
+                }
+
+                parseLink(header, callback);
+            }
+        }
+    }
+
+    // Call when monitorFd is readable, calls callback(std::string_view name,
+    // const LinkState &) for every link that changed.
+    template<typename Callback>
+    void processMonitor(Callback &&callback)
+    {
+        while (true) {
+            g_stats.netlinkCalls++;
+            const ssize_t length = receive_netlink(monitorFd, &buffer);
+
+            if (length < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+
+                // There might be more after one that didn't fit
+                if (errno == EMSGSIZE) {
+                    continue;
+                }
+
+                // ENOBUFS means we missed some, but the next dump fixes that
+                if (errno != EAGAIN && errno != ENOBUFS) {
+                    fprintf(stderr, "Failed to receive link changes: %s\n", strerror(errno));
+                }
+
+                return;
+            }
+
+            int remaining = length;
+
+            for (const nlmsghdr *header = reinterpret_cast<const nlmsghdr *>(buffer.data());
+                    NLMSG_OK(header, remaining); header = NLMSG_NEXT(header, remaining)) {
+                parseLink(header, callback);
+            }
+        }
+    }
+
+    bool available = false;
+    int monitorFd = -1;
+
+private:
+    // Big enough for a bunch of links per recv(), the dump is split up by
+    // the kernel anyways.
+    static constexpr size_t bufferSize = 32768;
+
+    template<typename Callback>
+    static void parseLink(const nlmsghdr *header, Callback &callback)
+    {
+        if (header->nlmsg_type != RTM_NEWLINK && header->nlmsg_type != RTM_DELLINK) {
+            return;
+        }
+
+        const ifinfomsg *info = static_cast<const ifinfomsg *>(NLMSG_DATA(header));
+        int attributesLength = IFLA_PAYLOAD(header);
+
+        std::string_view name;
+        LinkState state;
+        state.index = info->ifi_index;
+        uint8_t operstate = IF_OPER_UNKNOWN;
+
+        for (const rtattr *attribute = IFLA_RTA(info); RTA_OK(attribute, attributesLength);
+                attribute = RTA_NEXT(attribute, attributesLength)) {
+            switch (attribute->rta_type) {
+            case IFLA_IFNAME:
+                name = static_cast<const char *>(RTA_DATA(attribute));
+                break;
+
+            case IFLA_OPERSTATE:
+                operstate = *static_cast<const uint8_t *>(RTA_DATA(attribute));
+                break;
+
+            case IFLA_STATS64: {
+                // Might not be aligned for 64 bit reads
+                rtnl_link_stats64 stats = {};
+                memcpy(&stats, RTA_DATA(attribute), std::min<size_t>(sizeof stats, RTA_PAYLOAD(attribute)));
+                state.counters.rxBytes = stats.rx_bytes;
+                state.counters.txBytes = stats.tx_bytes;
+                state.haveCounters = true;
+                break;
+            }
+
+            default:
+                break;
+            }
+        }
+
+        state.up = header->nlmsg_type == RTM_NEWLINK &&
+                   (info->ifi_flags & IFF_LOWER_UP) &&
+                   (operstate == IF_OPER_UP || operstate == IF_OPER_UNKNOWN);
+
+        if (name.empty()) {
+            return;
+        }
+
+        callback(name, state);
+    }
+
+    int requestFd = -1;
+    uint32_t sequence = 0;
+    std::vector<char> buffer;
+};
+
+struct WifiStation {
+    int signalDbm = 0;
+    unsigned txBitrate = 0; // in 100 kbit/s
+    unsigned rxBitrate = 0; // in 100 kbit/s
+    uint8_t bssid[6] = {};
+    char ssid[33] = {};
+};
+
+// Asks nl80211 for the station info of the access point we're connected to,
+// one request per tick on a socket that's kept open.
+struct Nl80211Connection {
+    Nl80211Connection()
+    {
+        fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_GENERIC);
+
+        if (fd < 0) {
+            fprintf(stderr, "Failed to open generic netlink socket: %s\n", strerror(errno));
+            return;
+        }
+
+        buffer.resize(bufferSize);
+        familyId = resolveFamily();
+
+        if (!familyId) {
+            fprintf(stderr, "nl80211 not available\n");
+            return;
+        }
+
+        available = true;
+    }
+
+    ~Nl80211Connection()
+    {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    Nl80211Connection(const Nl80211Connection &) = delete;
+    Nl80211Connection &operator=(const Nl80211Connection &) = delete;
+
+    bool getStation(int ifindex, WifiStation *station)
+    {
+        if (!available || ifindex <= 0) {
+            return false;
+        }
+
+        const uint32_t attribute = ifindex;
+
+        if (!sendRequest(familyId, NL80211_CMD_GET_STATION, NLM_F_DUMP, NL80211_ATTR_IFINDEX, &attribute, sizeof attribute)) {
+            return false;
+        }
+
+        bool found = false;
+
+        const bool ok = receive([&](const nlattr *attribute, int remaining) {
+            for (; attribute_ok(attribute, remaining); attribute = attribute_next(attribute, &remaining)) {
+                switch (attribute->nla_type & NLA_TYPE_MASK) {
+                case NL80211_ATTR_MAC:
+                    memcpy(station->bssid, attribute_data(attribute), std::min<size_t>(sizeof station->bssid, attribute_length(attribute)));
+                    break;
+
+                case NL80211_ATTR_STA_INFO:
+                    parseStationInfo(attribute, station);
+                    found = true;
+                    break;
+
+                default:
+                    break;
+                }
+            }
+        });
+
+        if (!ok || !found) {
+            return false;
+        }
+
+        updateSsid(ifindex, station);
+        return true;
+    }
+
+    bool available = false;
+
+private:
+    static constexpr size_t bufferSize = 8192;
+
+    struct SsidCache {
+        int ifindex = 0;
+        uint8_t bssid[6] = {};
+        char ssid[33] = {};
+    };
+
+    static bool attribute_ok(const nlattr *attribute, int remaining)
+    {
+        return remaining >= int(sizeof *attribute) &&
+               attribute->nla_len >= sizeof *attribute &&
+               attribute->nla_len <= remaining;
+    }
+
+    static const nlattr *attribute_next(const nlattr *attribute, int *remaining)
+    {
+        const int length = NLA_ALIGN(attribute->nla_len);
+        *remaining -= length;
+        return reinterpret_cast<const nlattr *>(reinterpret_cast<const char *>(attribute) + length);
+    }
+
+    static const void *attribute_data(const nlattr *attribute)
+    {
+        return reinterpret_cast<const char *>(attribute) + NLA_HDRLEN;
+    }
+
+    static int attribute_length(const nlattr *attribute)
+    {
+        return attribute->nla_len - NLA_HDRLEN;
+    }
+
+    // In 100 kbit/s
+    static unsigned parseBitrate(const nlattr *rateInfo)
+    {
+        unsigned bitrate = 0;
+        int remaining = attribute_length(rateInfo);
+
+        for (const nlattr *attribute = static_cast<const nlattr *>(attribute_data(rateInfo));
+                attribute_ok(attribute, remaining); attribute = attribute_next(attribute, &remaining)) {
+            const uint16_t type = attribute->nla_type & NLA_TYPE_MASK;
+
+            if (type == NL80211_RATE_INFO_BITRATE32) {
+                uint32_t value;
+                memcpy(&value, attribute_data(attribute), sizeof value);
+                return value;
+            }
+
+            if (type == NL80211_RATE_INFO_BITRATE) {
+                uint16_t value;
+                memcpy(&value, attribute_data(attribute), sizeof value);
+                bitrate = value;
+            }
+        }
+
+        return bitrate;
+    }
+
+    static void parseStationInfo(const nlattr *stationInfo, WifiStation *station)
+    {
+        int remaining = attribute_length(stationInfo);
+
+        for (const nlattr *attribute = static_cast<const nlattr *>(attribute_data(stationInfo));
+                attribute_ok(attribute, remaining); attribute = attribute_next(attribute, &remaining)) {
+            switch (attribute->nla_type & NLA_TYPE_MASK) {
+            case NL80211_STA_INFO_SIGNAL:
+                station->signalDbm = *static_cast<const int8_t *>(attribute_data(attribute));
+                break;
+
+            case NL80211_STA_INFO_TX_BITRATE:
+                station->txBitrate = parseBitrate(attribute);
+                break;
+
+            case NL80211_STA_INFO_RX_BITRATE:
+                station->rxBitrate = parseBitrate(attribute);
+                break;
+
+            default:
+                break;
+            }
+        }
+    }
+
+    bool sendRequest(uint16_t type, uint8_t command, uint16_t flags, uint16_t attributeType, const void *data, size_t length)
+    {
+        struct {
+            nlmsghdr header;
+            genlmsghdr genl;
+            char attributes[64];
+        } request = {};
+
+        if (NLA_HDRLEN + NLA_ALIGN(length) > sizeof request.attributes) {
+            return false;
+        }
+
+        nlattr *attribute = reinterpret_cast<nlattr *>(request.attributes);
+        attribute->nla_type = attributeType;
+        attribute->nla_len = NLA_HDRLEN + length;
+        memcpy(request.attributes + NLA_HDRLEN, data, length);
+
+        request.header.nlmsg_len = NLMSG_LENGTH(GENL_HDRLEN) + NLA_ALIGN(attribute->nla_len);
+        request.header.nlmsg_type = type;
+        request.header.nlmsg_flags = NLM_F_REQUEST | flags;
+        request.header.nlmsg_seq = ++sequence;
+        request.genl.cmd = command;
+        request.genl.version = 1;
+
+        g_stats.netlinkCalls++;
+
+        if (send(fd, &request, request.header.nlmsg_len, 0) < 0) {
+            fprintf(stderr, "Failed to send generic netlink request: %s\n", strerror(errno));
+            return false;
+        }
+
+        return true;
+    }
+
+    // Calls callback(const nlattr *attributes, int length) for each reply
+    template<typename Callback>
+    bool receive(Callback &&callback)
+    {
+        while (true) {
+            g_stats.netlinkCalls++;
+            const ssize_t length = receive_netlink(fd, &buffer);
+
+            if (length < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+
+                fprintf(stderr, "Failed to receive generic netlink reply: %s\n", strerror(errno));
+                return false;
+            }
+
+            int remaining = length;
+            bool done = false;
+
+            for (const nlmsghdr *header = reinterpret_cast<const nlmsghdr *>(buffer.data());
+                    NLMSG_OK(header, remaining); header = NLMSG_NEXT(header, remaining)) {
+                if (header->nlmsg_seq != sequence) {
+                    continue;
+                }
+
+                if (header->nlmsg_type == NLMSG_DONE) {
+                    return true;
+                }
+
+                if (header->nlmsg_type == NLMSG_ERROR) {
+                    const nlmsgerr *error = static_cast<const nlmsgerr *>(NLMSG_DATA(header));
+
+                    // An ack, not an error
+                    if (error->error == 0) {
+                        return true;
+                    }
+
+                    // Not connected is not worth complaining about
+                    if (error->error != -ENOLINK && error->error != -ENODEV) {
+                        fprintf(stderr, "nl80211 request failed: %s\n", strerror(-error->error));
+                    }
+
+                    return false;
+                }
+
+                const int attributesLength = header->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN);
+                const nlattr *attributes = reinterpret_cast<const nlattr *>(
+                                               static_cast<const char *>(NLMSG_DATA(header)) + GENL_HDRLEN);
+                callback(attributes, attributesLength);
+
+                // Non-dump replies are just a single message
+                if (!(header->nlmsg_flags & NLM_F_MULTI)) {
+                    done = true;
+                }
+            }
+
+            if (done) {
+                return true;
+            }
+        }
+    }
+
+    uint16_t resolveFamily()
+    {
+        static const char name[] = "nl80211";
+
+        if (!sendRequest(GENL_ID_CTRL, CTRL_CMD_GETFAMILY, 0, CTRL_ATTR_FAMILY_NAME, name, sizeof name)) {
+            return 0;
+        }
+
+        uint16_t id = 0;
+
+        receive([&](const nlattr *attribute, int remaining) {
+            for (; attribute_ok(attribute, remaining); attribute = attribute_next(attribute, &remaining)) {
+                if (attribute->nla_type == CTRL_ATTR_FAMILY_ID) {
+                    memcpy(&id, attribute_data(attribute), sizeof id);
+                }
+            }
+        });
+
+        return id;
+    }
+
+    // The SSID only changes when we connect to a different access point, so
+    // only ask for it when the BSSID changes.
+    void updateSsid(int ifindex, WifiStation *station)
+    {
+        SsidCache *cache = nullptr;
+
+        for (SsidCache &candidate : ssids) {
+            if (candidate.ifindex == ifindex) {
+                cache = &candidate;
+                break;
+            }
+        }
+
+        if (!cache) {
+            ssids.emplace_back();
+            cache = &ssids.back();
+            cache->ifindex = ifindex;
+        } else if (memcmp(cache->bssid, station->bssid, sizeof cache->bssid) == 0) {
+            memcpy(station->ssid, cache->ssid, sizeof station->ssid);
+            return;
+        }
+
+        memcpy(cache->bssid, station->bssid, sizeof cache->bssid);
+        cache->ssid[0] = '\0';
+
+        const uint32_t attribute = ifindex;
+
+        if (sendRequest(familyId, NL80211_CMD_GET_INTERFACE, 0, NL80211_ATTR_IFINDEX, &attribute, sizeof attribute)) {
+            receive([&](const nlattr *attribute, int remaining) {
+                for (; attribute_ok(attribute, remaining); attribute = attribute_next(attribute, &remaining)) {
+                    if (attribute->nla_type == NL80211_ATTR_SSID) {
+                        const size_t length = std::min<size_t>(attribute_length(attribute), sizeof cache->ssid - 1);
+                        memcpy(cache->ssid, attribute_data(attribute), length);
+                        cache->ssid[length] = '\0';
+                    }
+                }
+            });
+        }
+
+        memcpy(station->ssid, cache->ssid, sizeof station->ssid);
+    }
+
+    int fd = -1;
+    uint16_t familyId = 0;
+    uint32_t sequence = 0;
+    std::vector<char> buffer;
+    std::vector<SsidCache> ssids;
+};
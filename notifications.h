@@ -1,49 +1,79 @@
 #pragma once
-#include "json_helpers.h"
+#include "notificationstore.h"
 
-#include <regex>
+#include <time.h>
 
 #include <systemd/sd-bus.h>
 
-struct Notification {
-    std::string app, message;
-    int timeout = 0;
-};
+static NotificationStore g_notifications;
 
-static void print_notification(Notification *notification)
-{
-    std::string message;
+// Where we're registered, for the signals
+static sd_bus *g_notificationBus = nullptr;
 
-    if (!notification->app.empty()) {
-        message += notification->app + ": ";
+static void emit_notification_closed(uint32_t id, NotificationCloseReason reason)
+{
+    if (!g_notificationBus || !id) {
+        return;
     }
 
-    message += notification->message;
+    const int ret = sd_bus_emit_signal(g_notificationBus, "/org/freedesktop/Notifications", "org.freedesktop.Notifications",
+                                       "NotificationClosed", "uu", id, uint32_t(reason));
+
+    if (ret < 0) {
+        fprintf(stderr, "Failed to emit NotificationClosed: %s\n", strerror(-ret));
+    }
+}
 
-    if (message.size() > 50) {
-        message.resize(50);
-        message += "...";
+static void emit_action_invoked(uint32_t id, const char *action)
+{
+    if (!g_notificationBus) {
+        return;
     }
 
-    fputs(message.c_str(), stdout);
+    const int ret = sd_bus_emit_signal(g_notificationBus, "/org/freedesktop/Notifications", "org.freedesktop.Notifications",
+                                       "ActionInvoked", "us", id, action);
 
-    if (notification->timeout % 2 == 0) {
-        print_black();
-        print_white_background();
+    if (ret < 0) {
+        fprintf(stderr, "Failed to emit ActionInvoked: %s\n", strerror(-ret));
     }
 }
 
-static std::vector<Notification> g_notifications;
-
-static int method_notify(sd_bus_message *m, void * /*userdata*/, sd_bus_error *error)
+// Only checks if there's a default action, which is what clicking it does
+static int read_actions(sd_bus_message *m, bool *hasDefault)
 {
-    //printf("Got called with userdata=%p\n", userdata);
+    int ret = sd_bus_message_enter_container(m, 'a', "s");
+
+    if (ret < 0) {
+        return ret;
+    }
+
+    // Pairs of key and label
+    const char *action = nullptr;
+    bool key = true;
+
+    while ((ret = sd_bus_message_read(m, "s", &action)) > 0) {
+        if (key && strcmp(action, "default") == 0) {
+            *hasDefault = true;
+        }
+
+        key = !key;
+    }
+
+    if (ret < 0) {
+        return ret;
+    }
+
+    return sd_bus_message_exit_container(m);
+}
 
+static int method_notify(sd_bus_message *m, void * /*userdata*/, sd_bus_error * /*error*/)
+{
     const char *app_name = nullptr;
     uint32_t replaces_id = 0u;
     const char *app_icon = nullptr;
     const char *summary = nullptr;
     const char *body = nullptr;
+    bool hasDefaultAction = false;
 
     int timeout = 0;
 
@@ -54,11 +84,19 @@ static int method_notify(sd_bus_message *m, void * /*userdata*/, sd_bus_error *e
         return ret;
     }
 
+    ret = read_actions(m, &hasDefaultAction);
+
+    if (ret < 0) {
+        fprintf(stderr, "Failed to parse actions: %s\n", strerror(-ret));
+        return ret;
+    }
+
     // Can't be bothered to parse these, which aren't used
-    ret = sd_bus_message_skip(m, "asa{sv}");
+    ret = sd_bus_message_skip(m, "a{sv}");
 
     if (ret < 0) {
-        fprintf(stderr, "Failed to skip parameters: %s\n", strerror(-ret));
+        fprintf(stderr, "Failed to skip hints: %s\n", strerror(-ret));
+        return ret;
     }
 
     ret = sd_bus_message_read(m, "i", &timeout);
@@ -68,40 +106,34 @@ static int method_notify(sd_bus_message *m, void * /*userdata*/, sd_bus_error *e
         return ret;
     }
 
-    /* Return an error on division by zero */
-    if (false) {
-        sd_bus_error_set_const(error, "net.poettering.DivisionByZero", "Sorry, can't allow division by zero.");
-        return -EINVAL;
-    }
+    timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    const uint64_t nowMs = now.tv_sec * 1000ULL + now.tv_nsec / 1000000;
 
-    if (!g_notifications.empty()) {
-        if (g_notifications.size() > 5) { // don't have too many..
-            g_notifications.resize(5);
-        }
+    uint32_t dropped = 0;
+    const uint32_t id = g_notifications.notify(replaces_id, app_name, summary, body, timeout, hasDefaultAction, nowMs, &dropped);
 
-        // Clean out old ones
-        for (Notification &notification : g_notifications) {
-            notification.timeout = 1;
-        }
-    }
+    // Didn't get to be shown
+    emit_notification_closed(dropped, NotificationUndefined);
 
-    std::regex stripRegex("[^a-zA-Z0-9.,#_\\- ]");
+    return sd_bus_reply_method_return(m, "u", id);
+}
 
-    Notification notification;
-    notification.app = std::regex_replace(app_name, stripRegex, "");
-    notification.message = std::regex_replace(summary, stripRegex, "");
+static int method_closenotification(sd_bus_message *m, void * /*userdata*/, sd_bus_error * /*error*/)
+{
+    uint32_t id = 0;
+    const int ret = sd_bus_message_read(m, "u", &id);
 
-    if (notification.message.empty()) {
-        notification.message = body;
+    if (ret < 0) {
+        fprintf(stderr, "Failed to parse id: %s\n", strerror(-ret));
+        return ret;
     }
 
-    notification.timeout = std::max(timeout, 10000) / 1000;
-    g_notifications.push_back(std::move(notification));
-
-    static int id = 0;
-    fprintf(stderr, "%s %u %s %s %s %d\n", app_name, replaces_id, app_icon, summary, body, timeout);
+    if (g_notifications.close(id)) {
+        emit_notification_closed(id, NotificationClosedByCall);
+    }
 
-    return sd_bus_reply_method_return(m, "u", id++);
+    return sd_bus_reply_method_return(m, "");
 }
 
 static int method_getcapabilities(sd_bus_message *m, void * /*userdata*/, sd_bus_error *error)
@@ -140,8 +172,12 @@ static const sd_bus_vtable notifications_vtable[] = {
                   method_notify,
                   SD_BUS_VTABLE_UNPRIVILEGED),
 
+    SD_BUS_METHOD("CloseNotification", "u", "", method_closenotification, SD_BUS_VTABLE_UNPRIVILEGED),
     SD_BUS_METHOD("GetCapabilities", "", "as", method_getcapabilities, SD_BUS_VTABLE_UNPRIVILEGED),
 
+    SD_BUS_SIGNAL("NotificationClosed", "uu", 0),
+    SD_BUS_SIGNAL("ActionInvoked", "us", 0),
+
     // Instead of using SD_BUS_VTABLE_END do it 'manually' to squash compiler
     // warnings
     { .type = _SD_BUS_VTABLE_END, .flags = 0, .x = { { 0, 0, 0 } } },
@@ -173,16 +209,6 @@ bool register_notification_service(sd_bus *bus, sd_bus_slot **slot)
         return false;
     }
 
+    g_notificationBus = bus;
     return true;
 }
-
-void process_bus(sd_bus *bus)
-{
-    int ret = sd_bus_process(bus, NULL);
-
-    if (ret < 0) {
-        fprintf(stderr, "Failed to process bus: %s\n", strerror(-ret));
-        return;
-    }
-}
-
@@ -0,0 +1,193 @@
+#pragma once
+
+#include "json_helpers.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <string_view>
+
+// Why a notification went away, as in the notification spec
+enum NotificationCloseReason : uint32_t {
+    NotificationExpired = 1,
+    NotificationDismissed = 2,
+    NotificationClosedByCall = 3,
+    NotificationUndefined = 4,
+};
+
+// Only lets through what we're fine showing, and as much as fits in size
+// (including the terminating null). Returns the length.
+inline size_t sanitize_notification_text(std::string_view text, char *out, size_t size)
+{
+    size_t length = 0;
+
+    for (const char c : text) {
+        if (length + 1 >= size) {
+            break;
+        }
+
+        if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+                c == '.' || c == ',' || c == '#' || c == '_' || c == '-' || c == ' ') {
+            out[length++] = c;
+        }
+    }
+
+    out[length] = '\0';
+    return length;
+}
+
+struct Notification {
+    uint32_t id = 0;
+    uint64_t expiresMs = 0; // realtime, so it's the same however often we wake up
+    bool hasDefaultAction = false;
+
+    // Only 50 characters are shown anyways
+    char app[32] = {};
+    char message[64] = {};
+};
+
+// The notifications we're showing, oldest first. Fixed size, so something
+// sending a lot of them can't make us allocate; when it's full the oldest
+// one is dropped.
+struct NotificationStore {
+    static constexpr size_t capacity = 8;
+
+    // Returns the id, which is replacesId if we still have that one. If
+    // something had to be dropped to make room its id is in dropped,
+    // otherwise that's 0.
+    uint32_t notify(uint32_t replacesId, std::string_view app, std::string_view summary, std::string_view body,
+                    int timeoutMs, bool hasDefaultAction, uint64_t nowMs, uint32_t *dropped)
+    {
+        *dropped = 0;
+
+        Notification *notification = replacesId ? find(replacesId) : nullptr;
+
+        if (!notification) {
+            // Clean out old ones
+            for (size_t i = 0; i < count; i++) {
+                at(i).expiresMs = std::min(at(i).expiresMs, nowMs + 1000);
+            }
+
+            if (count == capacity) {
+                *dropped = popFront();
+            }
+
+            notification = &at(count++);
+            notification->id = nextId++;
+
+            // 0 means none
+            if (!nextId) {
+                nextId = 1;
+            }
+        }
+
+        sanitize_notification_text(app, notification->app, sizeof notification->app);
+
+        if (!sanitize_notification_text(summary, notification->message, sizeof notification->message)) {
+            sanitize_notification_text(body, notification->message, sizeof notification->message);
+        }
+
+        notification->expiresMs = nowMs + std::max(timeoutMs, 10000);
+        notification->hasDefaultAction = hasDefaultAction;
+
+        return notification->id;
+    }
+
+    Notification *find(uint32_t id)
+    {
+        for (size_t i = 0; i < count; i++) {
+            if (at(i).id == id) {
+                return &at(i);
+            }
+        }
+
+        return nullptr;
+    }
+
+    // Returns false if we don't have it (anymore)
+    bool close(uint32_t id)
+    {
+        for (size_t i = 0; i < count; i++) {
+            if (at(i).id != id) {
+                continue;
+            }
+
+            // Move the newer ones down
+            for (size_t j = i; j + 1 < count; j++) {
+                at(j) = at(j + 1);
+            }
+
+            count--;
+            return true;
+        }
+
+        return false;
+    }
+
+    // Returns the id of the one removed
+    uint32_t popFront()
+    {
+        const uint32_t id = at(0).id;
+        first = (first + 1) % capacity;
+        count--;
+        return id;
+    }
+
+    Notification &front()
+    {
+        return at(0);
+    }
+
+    bool empty() const
+    {
+        return count == 0;
+    }
+
+    size_t size() const
+    {
+        return count;
+    }
+
+private:
+    Notification &at(size_t index)
+    {
+        return items[(first + index) % capacity];
+    }
+
+    Notification items[capacity];
+    size_t first = 0;
+    size_t count = 0;
+    uint32_t nextId = 1;
+};
+
+inline void print_notification(LineBuffer &out, const Notification &notification, uint64_t nowMs)
+{
+    static constexpr size_t maxLength = 50;
+    static_assert(sizeof Notification::app + 2 < maxLength, "app name doesn't leave room for the message");
+
+    const std::string_view app(notification.app);
+    const std::string_view message(notification.message);
+    size_t length = 0;
+
+    if (!app.empty()) {
+        out.appendEscaped(app);
+        out.append(": ");
+        length = app.size() + 2;
+    }
+
+    out.appendEscaped(message.substr(0, maxLength - length));
+
+    if (length + message.size() > maxLength) {
+        out.append("...");
+    }
+
+    // Flashes every other second
+    const uint64_t secondsLeft = notification.expiresMs > nowMs ? (notification.expiresMs - nowMs) / 1000 : 0;
+
+    if (secondsLeft % 2 == 0) {
+        print_black(out);
+        print_white_background(out);
+    }
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include "filecache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+// A kernel PSI trigger, the fd gets EPOLLPRI when tasks have been stalled
+// for more than thresholdUs in any windowUs, so we hear about it right away
+// instead of when we next look at the averages. Unprivileged users can only
+// use windows that are a multiple of 2 seconds (and only since 6.5).
+// See Documentation/accounting/psi.rst in the kernel.
+struct PressureTrigger {
+    PressureTrigger() = default;
+
+    PressureTrigger(const PressureTrigger &) = delete;
+    PressureTrigger &operator=(const PressureTrigger &) = delete;
+
+    ~PressureTrigger()
+    {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    // kind is "some" or "full"
+    bool arm(const char *path, const char *kind, unsigned thresholdUs, unsigned windowUs)
+    {
+        fd = open(rooted_path(path).c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+
+        if (fd < 0) {
+            fprintf(stderr, "Failed to open %s for a trigger: %s\n", path, strerror(errno));
+            return false;
+        }
+
+        char trigger[64];
+        const int length = snprintf(trigger, sizeof trigger, "%s %u %u", kind, thresholdUs, windowUs);
+
+        // The kernel wants the terminating null too
+        if (write(fd, trigger, length + 1) < 0) {
+            fprintf(stderr, "Failed to set up trigger '%s' on %s: %s\n", trigger, path, strerror(errno));
+            close(fd);
+            fd = -1;
+            return false;
+        }
+
+        return true;
+    }
+
+    int fd = -1;
+};
@@ -0,0 +1,344 @@
+#pragma once
+
+// Single pass parsers for the files in /proc we read every second. They work
+// directly on the buffer from CachedFile, stop as soon as they have what they
+// need and never allocate.
+
+#include <stddef.h>
+#include <string.h>
+
+#include <algorithm>
+#include <string_view>
+
+namespace procparse {
+
+inline const char *skip_spaces(const char *p)
+{
+    while (*p == ' ' || *p == '\t') {
+        p++;
+    }
+
+    return p;
+}
+
+inline const char *next_line(const char *p)
+{
+    p = strchr(p, '\n');
+    return p ? p + 1 : nullptr;
+}
+
+// Returns nullptr if there's no number at p
+inline const char *parse_number(const char *p, unsigned long long *value)
+{
+    p = skip_spaces(p);
+
+    if (*p < '0' || *p > '9') {
+        return nullptr;
+    }
+
+    unsigned long long result = 0;
+
+    while (*p >= '0' && *p <= '9') {
+        result = result * 10 + (*p - '0');
+        p++;
+    }
+
+    *value = result;
+    return p;
+}
+
+} // namespace procparse
+
+struct CpuTimes {
+    unsigned long long user = 0, nice = 0, system = 0, idle = 0, iowait = 0;
+    unsigned long long irq = 0, softirq = 0, steal = 0, guest = 0, guestNice = 0;
+};
+
+// Only looks at the first line, the sum of all CPUs
+inline bool parse_proc_stat(const char *buffer, CpuTimes *times)
+{
+    using namespace procparse;
+
+    if (strncmp(buffer, "cpu ", 4) != 0) {
+        return false;
+    }
+
+    unsigned long long *fields[] = {
+        &times->user, &times->nice, &times->system, &times->idle, &times->iowait,
+        &times->irq, &times->softirq, &times->steal, &times->guest, &times->guestNice
+    };
+
+    const char *p = buffer + 4;
+    size_t parsed = 0;
+
+    for (unsigned long long *field : fields) {
+        p = parse_number(p, field);
+
+        if (!p) {
+            break;
+        }
+
+        parsed++;
+    }
+
+    // Older kernels don't have all of them
+    return parsed >= 4;
+}
+
+struct MemInfo {
+    unsigned long long total = 0; // kB
+    unsigned long long available = 0; // kB
+};
+
+inline bool parse_meminfo(const char *buffer, MemInfo *info)
+{
+    using namespace procparse;
+
+    bool foundTotal = false;
+    bool foundAvailable = false;
+
+    for (const char *line = buffer; line && *line; line = next_line(line)) {
+        if (strncmp(line, "MemTotal:", 9) == 0) {
+            foundTotal = parse_number(line + 9, &info->total) != nullptr;
+        } else if (strncmp(line, "MemAvailable:", 13) == 0) {
+            foundAvailable = parse_number(line + 13, &info->available) != nullptr;
+        } else {
+            continue;
+        }
+
+        if (foundTotal && foundAvailable) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+struct NetDevCounters {
+    unsigned long long rxBytes = 0;
+    unsigned long long txBytes = 0;
+};
+
+// Calls callback(std::string_view name, const NetDevCounters &) for every
+// interface, until it returns false.
+template<typename Callback>
+inline void parse_net_dev(const char *buffer, Callback &&callback)
+{
+    using namespace procparse;
+
+    // First two lines are headers
+    const char *line = next_line(buffer);
+    line = line ? next_line(line) : nullptr;
+
+    for (; line && *line; line = next_line(line)) {
+        const char *name = skip_spaces(line);
+        const char *colon = name;
+
+        while (*colon && *colon != ':' && *colon != '\n') {
+            colon++;
+        }
+
+        if (*colon != ':') {
+            continue;
+        }
+
+        // rx: bytes packets errs drop fifo frame compressed multicast
+        // tx: bytes ...
+        unsigned long long values[9];
+        const char *p = colon + 1;
+        size_t parsed = 0;
+
+        for (unsigned long long &value : values) {
+            p = parse_number(p, &value);
+
+            if (!p) {
+                break;
+            }
+
+            parsed++;
+        }
+
+        if (parsed != 9) {
+            continue;
+        }
+
+        NetDevCounters counters;
+        counters.rxBytes = values[0];
+        counters.txBytes = values[8];
+
+        if (!callback(std::string_view(name, colon - name), counters)) {
+            return;
+        }
+    }
+}
+
+struct DiskCounters {
+    unsigned long long reads = 0, sectorsRead = 0;
+    unsigned long long writes = 0, sectorsWritten = 0;
+    unsigned long long ioTicksMs = 0; // time it was busy with anything
+};
+
+// /proc/diskstats, "   8       0 sda 4461 1279 301234 2045 ..." with one line
+// per block device. Calls callback(std::string_view name, const DiskCounters &)
+// for each, until it returns false.
+template<typename Callback>
+inline void parse_diskstats(const char *buffer, Callback &&callback)
+{
+    using namespace procparse;
+
+    for (const char *line = buffer; line && *line; line = next_line(line)) {
+        unsigned long long major, minor;
+        const char *p = parse_number(line, &major);
+        p = p ? parse_number(p, &minor) : nullptr;
+
+        if (!p) {
+            continue;
+        }
+
+        const char *name = skip_spaces(p);
+        const char *end = name;
+
+        while (*end && *end != ' ' && *end != '\n') {
+            end++;
+        }
+
+        // reads, merged, sectors, ms, writes, merged, sectors, ms, in
+        // progress, io ticks, and then more that we don't need
+        unsigned long long values[10];
+        p = end;
+        size_t parsed = 0;
+
+        for (unsigned long long &value : values) {
+            p = parse_number(p, &value);
+
+            if (!p) {
+                break;
+            }
+
+            parsed++;
+        }
+
+        if (parsed != 10 || end == name) {
+            continue;
+        }
+
+        DiskCounters counters;
+        counters.reads = values[0];
+        counters.sectorsRead = values[2];
+        counters.writes = values[4];
+        counters.sectorsWritten = values[6];
+        counters.ioTicksMs = values[9];
+
+        if (!callback(std::string_view(name, end - name), counters)) {
+            return;
+        }
+    }
+}
+
+struct ProcessStat {
+    char name[16] = {}; // comm, which the kernel cuts to 15 characters anyways
+    unsigned long long cpuTicks = 0; // utime + stime
+    unsigned long long rssPages = 0;
+};
+
+// /proc/[pid]/stat, "1234 (name) S 1 ..." where the name can have anything
+// in it, including spaces and parentheses, so go by the last ')'.
+inline bool parse_pid_stat(const char *buffer, ProcessStat *stat)
+{
+    using namespace procparse;
+
+    const char *open = strchr(buffer, '(');
+    const char *close = strrchr(buffer, ')');
+
+    if (!open || !close || close < open) {
+        return false;
+    }
+
+    const size_t length = std::min<size_t>(close - open - 1, sizeof stat->name - 1);
+    memcpy(stat->name, open + 1, length);
+    stat->name[length] = '\0';
+
+    // Then state is field 3, utime and stime are 14 and 15, rss is 24
+    const char *p = skip_spaces(close + 1);
+
+    if (!*p) {
+        return false;
+    }
+
+    p++;
+
+    unsigned long long utime = 0, stime = 0;
+
+    for (int field = 4; field <= 24; field++) {
+        unsigned long long value;
+
+        // Some of them can be negative, but none we need
+        p = skip_spaces(p);
+
+        if (*p == '-') {
+            p++;
+        }
+
+        p = parse_number(p, &value);
+
+        if (!p) {
+            return false;
+        }
+
+        if (field == 14) {
+            utime = value;
+        } else if (field == 15) {
+            stime = value;
+        } else if (field == 24) {
+            stat->rssPages = value;
+        }
+    }
+
+    stat->cpuTicks = utime + stime;
+    return true;
+}
+
+// In hundredths of a percent, so there's no floating point parsing
+struct PressureStats {
+    unsigned someAvg10 = 0;
+    unsigned fullAvg10 = 0;
+    bool haveFull = false; // cpu only has it since 5.13, and it's always 0 for the whole system
+};
+
+// /proc/pressure/{cpu,memory,io}, like
+// some avg10=0.12 avg60=0.05 avg300=0.01 total=123456
+// full avg10=0.00 avg60=0.00 avg300=0.00 total=4567
+inline bool parse_pressure(const char *buffer, PressureStats *stats)
+{
+    using namespace procparse;
+
+    bool haveSome = false;
+
+    for (const char *line = buffer; line && *line; line = next_line(line)) {
+        const bool some = strncmp(line, "some avg10=", 11) == 0;
+
+        if (!some && strncmp(line, "full avg10=", 11) != 0) {
+            continue;
+        }
+
+        unsigned long long whole = 0, fraction = 0;
+        const char *p = parse_number(line + 11, &whole);
+
+        if (!p || *p != '.' || !parse_number(p + 1, &fraction)) {
+            return false;
+        }
+
+        // Always two decimals
+        const unsigned value = whole * 100 + fraction;
+
+        if (some) {
+            stats->someAvg10 = value;
+            haveSome = true;
+        } else {
+            stats->fullAvg10 = value;
+            stats->haveFull = true;
+        }
+    }
+
+    return haveSome;
+}
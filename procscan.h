@@ -0,0 +1,379 @@
+#pragma once
+
+#include "filecache.h"
+#include "procparsers.h"
+#include "stats.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+// Name of whoever is using the most, empty if we don't know (yet)
+struct TopProcess {
+    char name[16] = {};
+};
+
+// Finds the process responsible when the cpu or memory segments are
+// alerting, and does nothing at all the rest of the time.
+//
+// Opening /proc/[pid]/stat for every process is what costs, so all of them
+// are only scanned every fullScanIntervalMs (and twice at the start, to get
+// something to compare with). In between only the few that were at the top
+// last time are read again, with pread() on fds we keep open.
+struct ProcessScanner {
+    enum Metric {
+        Cpu = 1,
+        Memory = 2,
+    };
+
+    ProcessScanner() = default;
+
+    ProcessScanner(const ProcessScanner &) = delete;
+    ProcessScanner &operator=(const ProcessScanner &) = delete;
+
+    ~ProcessScanner()
+    {
+        stop();
+    }
+
+    // Call each time the segment is alerting, updates at most once for the
+    // same nowMs so the cpu and memory segments can share it.
+    TopProcess top(Metric metric, uint64_t nowMs)
+    {
+        wanted |= metric;
+        update(nowMs);
+
+        TopProcess result;
+        const Candidate *best = nullptr;
+        const Candidate *largest = nullptr;
+
+        for (unsigned i = 0; i < candidateCount; i++) {
+            const Candidate &candidate = candidates[i];
+
+            if (metric == Cpu && candidate.cpuDelta > 0 && (!best || candidate.cpuDelta > best->cpuDelta)) {
+                best = &candidate;
+            } else if (metric == Memory && candidate.rssDelta > 0 && (!best || candidate.rssDelta > best->rssDelta)) {
+                best = &candidate;
+            }
+
+            if (!largest || candidate.stat.rssPages > largest->stat.rssPages) {
+                largest = &candidate;
+            }
+        }
+
+        // Usually memory is high because something already grew and then
+        // stayed there, so blame the biggest one if nothing is growing now
+        if (metric == Memory && !best) {
+            best = largest;
+        }
+
+        if (best) {
+            memcpy(result.name, best->stat.name, sizeof result.name);
+        }
+
+        return result;
+    }
+
+    // Call when the segment isn't alerting anymore
+    void release(Metric metric)
+    {
+        if (!(wanted & metric)) {
+            return;
+        }
+
+        wanted &= ~metric;
+
+        if (!wanted) {
+            stop();
+        }
+    }
+
+    // Does a full scan or a refresh of the top ones, depending on how long
+    // since the last full scan
+    void update(uint64_t nowMs)
+    {
+        if (nowMs == lastUpdateMs) {
+            return;
+        }
+
+        PhaseTimer timer(SelfStats::ProcScan);
+
+        if (!haveDeltas || nowMs - lastFullScanMs >= fullScanIntervalMs) {
+            if (fullScan()) {
+                lastFullScanMs = nowMs;
+            }
+        } else {
+            refresh();
+        }
+
+        lastUpdateMs = nowMs;
+    }
+
+    // Everything from the full scans, sorted on pid
+    size_t processCount() const
+    {
+        return processes.size();
+    }
+
+    uint64_t fullScanIntervalMs = 30000;
+
+private:
+    struct Process {
+        int pid = 0;
+        ProcessStat stat;
+        unsigned long long cpuDelta = 0;
+        long long rssDelta = 0;
+    };
+
+    // One of the top ones, with its stat file kept open
+    struct Candidate : Process {
+        int fd = -1;
+    };
+
+    static constexpr unsigned maxCandidates = 8;
+
+    bool fullScan()
+    {
+        if (dirFd < 0) {
+            dirFd = open(rooted_path("/proc").c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+            if (dirFd < 0) {
+                fprintf(stderr, "Failed to open /proc: %s\n", strerror(errno));
+                return false;
+            }
+        } else if (lseek(dirFd, 0, SEEK_SET) < 0) {
+            fprintf(stderr, "Failed to rewind /proc: %s\n", strerror(errno));
+            return false;
+        }
+
+        previous.swap(processes);
+        processes.clear();
+
+        while (true) {
+            const long length = syscall(SYS_getdents64, dirFd, dirents, sizeof dirents);
+
+            if (length < 0) {
+                fprintf(stderr, "Failed to list /proc: %s\n", strerror(errno));
+                return false;
+            }
+
+            if (length == 0) {
+                break;
+            }
+
+            for (long offset = 0; offset < length;) {
+                const dirent64 *entry = reinterpret_cast<const dirent64 *>(dirents + offset);
+                offset += entry->d_reclen;
+
+                if ((entry->d_type != DT_DIR && entry->d_type != DT_UNKNOWN) || entry->d_name[0] < '0' || entry->d_name[0] > '9') {
+                    continue;
+                }
+
+                char path[sizeof entry->d_name + sizeof "/stat"];
+                snprintf(path, sizeof path, "%s/stat", entry->d_name);
+
+                const int fd = openat(dirFd, path, O_RDONLY | O_CLOEXEC);
+
+                // Might have exited already
+                if (fd < 0) {
+                    continue;
+                }
+
+                Process process;
+                process.pid = atoi(entry->d_name);
+
+                if (readStat(fd, &process.stat)) {
+                    processes.push_back(process);
+                }
+
+                close(fd);
+            }
+        }
+
+        // The kernel lists them in order anyways
+        if (!std::is_sorted(processes.begin(), processes.end(), byPid)) {
+            std::sort(processes.begin(), processes.end(), byPid);
+        }
+
+        haveDeltas = !previous.empty();
+
+        if (!haveDeltas) {
+            return true;
+        }
+
+        for (Process &process : processes) {
+            auto last = std::lower_bound(previous.begin(), previous.end(), process, byPid);
+
+            if (last == previous.end() || last->pid != process.pid) {
+                continue;
+            }
+
+            process.cpuDelta = process.stat.cpuTicks - std::min(process.stat.cpuTicks, last->stat.cpuTicks);
+            process.rssDelta = (long long)process.stat.rssPages - (long long)last->stat.rssPages;
+        }
+
+        pickCandidates();
+        return true;
+    }
+
+    // The top half by cpu, and the rest split between the ones growing the
+    // most and the biggest ones
+    void pickCandidates()
+    {
+        closeCandidates();
+
+        const Process *byCpu[maxCandidates / 2] = {};
+        const Process *byGrowth[maxCandidates / 4] = {};
+        const Process *bySize[maxCandidates / 4] = {};
+
+        for (const Process &process : processes) {
+            insertTop(byCpu, &process, [](const Process *a, const Process *b) {
+                return a->cpuDelta > b->cpuDelta;
+            });
+            insertTop(byGrowth, &process, [](const Process *a, const Process *b) {
+                return a->rssDelta > b->rssDelta;
+            });
+            insertTop(bySize, &process, [](const Process *a, const Process *b) {
+                return a->stat.rssPages > b->stat.rssPages;
+            });
+        }
+
+        addCandidates(byCpu);
+        addCandidates(byGrowth);
+        addCandidates(bySize);
+    }
+
+    template<size_t Size>
+    void addCandidates(const Process *(&top)[Size])
+    {
+        for (size_t i = 0; i < Size && top[i]; i++) {
+            addCandidate(*top[i]);
+        }
+    }
+
+    template<size_t Size, typename Compare>
+    static void insertTop(const Process *(&top)[Size], const Process *process, Compare &&better)
+    {
+        for (size_t i = 0; i < Size; i++) {
+            if (!top[i] || better(process, top[i])) {
+                std::move_backward(top + i, top + Size - 1, top + Size);
+                top[i] = process;
+                return;
+            }
+        }
+    }
+
+    void addCandidate(const Process &process)
+    {
+        for (unsigned i = 0; i < candidateCount; i++) {
+            if (candidates[i].pid == process.pid) {
+                return;
+            }
+        }
+
+        char path[32];
+        snprintf(path, sizeof path, "%d/stat", process.pid);
+
+        const int fd = openat(dirFd, path, O_RDONLY | O_CLOEXEC);
+
+        if (fd < 0) {
+            return;
+        }
+
+        Candidate &candidate = candidates[candidateCount++];
+        static_cast<Process &>(candidate) = process;
+        candidate.fd = fd;
+    }
+
+    // Just the top ones, since the last time
+    void refresh()
+    {
+        unsigned kept = 0;
+
+        for (unsigned i = 0; i < candidateCount; i++) {
+            Candidate &candidate = candidates[i];
+            ProcessStat stat;
+
+            // Gone, the fd is for a dead process now
+            if (!readStat(candidate.fd, &stat)) {
+                close(candidate.fd);
+                continue;
+            }
+
+            candidate.cpuDelta = stat.cpuTicks - std::min(stat.cpuTicks, candidate.stat.cpuTicks);
+            candidate.rssDelta = (long long)stat.rssPages - (long long)candidate.stat.rssPages;
+            candidate.stat = stat;
+
+            candidates[kept++] = candidate;
+        }
+
+        candidateCount = kept;
+    }
+
+    bool readStat(int fd, ProcessStat *stat)
+    {
+        g_stats.reads++;
+        const ssize_t length = pread(fd, statBuffer, sizeof statBuffer - 1, 0);
+
+        if (length <= 0) {
+            return false;
+        }
+
+        statBuffer[length] = '\0';
+        return parse_pid_stat(statBuffer, stat);
+    }
+
+    void closeCandidates()
+    {
+        for (unsigned i = 0; i < candidateCount; i++) {
+            close(candidates[i].fd);
+        }
+
+        candidateCount = 0;
+    }
+
+    // Keeps the memory for the next time
+    void stop()
+    {
+        closeCandidates();
+
+        if (dirFd >= 0) {
+            close(dirFd);
+            dirFd = -1;
+        }
+
+        processes.clear();
+        previous.clear();
+        haveDeltas = false;
+        lastUpdateMs = 0;
+    }
+
+    static bool byPid(const Process &a, const Process &b)
+    {
+        return a.pid < b.pid;
+    }
+
+    unsigned wanted = 0;
+
+    int dirFd = -1;
+    alignas(dirent64) char dirents[16384];
+    char statBuffer[1024];
+
+    std::vector<Process> processes;
+    std::vector<Process> previous;
+    bool haveDeltas = false;
+
+    Candidate candidates[maxCandidates];
+    unsigned candidateCount = 0;
+
+    uint64_t lastUpdateMs = 0;
+    uint64_t lastFullScanMs = 0;
+};
@@ -3,8 +3,11 @@
 
 // C
 #include <err.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
 
 // C++
 #include <string>
@@ -15,130 +18,91 @@
 #include <pulse/pulseaudio.h>
 
 namespace {
-static void connect_state_cb(pa_context *context, void *raw)
-{
-    int err = pa_context_errno(context);
-
-    if (err) {
-        fprintf(stderr, "connect state error: %s\n", pa_strerror(err));
-    }
-
-    enum pa_context_state *state = static_cast<enum pa_context_state *>(raw);
-    *state = pa_context_get_state(context);
-}
-
-template<typename T>
-static void device_info_cb(pa_context *context,
-                           const T *info,
-                           int eol,
-                           void *raw)
-{
-    if (eol < 0) {
-        fprintf(stderr, "%s error in %s: \n", __func__,
-                pa_strerror(pa_context_errno(context)));
-        return;
-    }
-
-    if (!eol) {
-        vector<Sink> *devices_ = static_cast<vector<Sink>*>(raw);
-        devices_->push_back(info);
-    }
-}
-
-static void server_info_cb(pa_context *context __attribute__((unused)),
-                           const pa_server_info *i,
-                           void *raw)
-{
-    std::string *default_sink = static_cast<std::string *>(raw);
-    *default_sink = i->default_sink_name;
-}
+// How long to wait before trying again if we can't connect
+const pa_usec_t reconnect_delay_usec = 2 * PA_USEC_PER_SEC;
 
 static int volume_as_percent(const pa_cvolume *cvol)
 {
     return int(pa_cvolume_avg(cvol) * 100.0 / PA_VOLUME_NORM);
 }
 
-static int xstrtol(const char *str, long *out)
-{
-    char *end = nullptr;
-
-    if (str == nullptr || *str == '\0') {
-        return -1;
-    }
-
-    errno = 0;
-
-    *out = strtol(str, &end, 10);
-
-    if (errno || str == end || (end && *end)) {
-        return -1;
-    }
-
-    return 0;
-}
-
 }  // anonymous namespace
 
 PulseClient::PulseClient(string client_name) :
     client_name_(client_name),
     context_(nullptr),
-    mainloop_(nullptr),
-    state_(PA_CONTEXT_UNCONNECTED)
+    mainloop_(nullptr)
 {
     connect_props_ = pa_proplist_new();
     pa_proplist_sets(connect_props_, PA_PROP_APPLICATION_NAME, client_name_.c_str());
     pa_proplist_sets(connect_props_, PA_PROP_APPLICATION_ID, "com.iskrembilen.status");
     pa_proplist_sets(connect_props_, PA_PROP_APPLICATION_VERSION, STATUS_VERSION);
     pa_proplist_sets(connect_props_, PA_PROP_APPLICATION_ICON_NAME, "audio-card");
+
+    event_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    if (event_fd_ < 0) {
+        fprintf(stderr, "failed to create eventfd for pulse: %s\n", strerror(errno));
+    }
 }
 
 void PulseClient::deinit()
 {
+    if (mainloop_) {
+        pa_threaded_mainloop_stop(mainloop_);
+    }
+
     if (context_) {
+        pa_context_disconnect(context_);
         pa_context_unref(context_);
         context_ = nullptr;
     }
 
+    // Frees the retry timer too
     if (mainloop_) {
-        pa_mainloop_quit(mainloop_, 0);
-        pa_mainloop_free(mainloop_);
+        pa_threaded_mainloop_free(mainloop_);
         mainloop_ = nullptr;
     }
+
+    retry_event_ = nullptr;
+    have_default_sink_ = false;
+    needs_reconnect_ = false;
 }
 
-bool PulseClient::init()
+bool PulseClient::Connect()
 {
-    state_ = PA_CONTEXT_CONNECTING;
+    deinit();
 
+    mainloop_ = pa_threaded_mainloop_new();
 
-    deinit();
+    if (!mainloop_) {
+        fprintf(stderr, "failed to create pulse mainloop\n");
+        return false;
+    }
 
-    mainloop_ = pa_mainloop_new();
-    context_ = pa_context_new_with_proplist(pa_mainloop_get_api(mainloop_),
+    context_ = pa_context_new_with_proplist(pa_threaded_mainloop_get_api(mainloop_),
                                             nullptr, connect_props_);
 
-    pa_context_set_state_callback(context_, connect_state_cb, &state_);
-    pa_context_connect(context_, nullptr, PA_CONTEXT_NOFLAGS, nullptr);
+    pa_context_set_state_callback(context_, state_cb, this);
+    pa_context_set_subscribe_callback(context_, subscribe_cb, this);
 
-    while (state_ != PA_CONTEXT_READY && state_ != PA_CONTEXT_FAILED) {
-        int err = 0;
-        int processed = pa_mainloop_iterate(mainloop_, 1, &err);
+    // NOFAIL means it waits for the daemon to show up if it isn't running
+    // yet, but it can still fail, e. g. at login before it's set up
+    const bool connecting = pa_context_connect(context_, nullptr, PA_CONTEXT_NOFAIL, nullptr) >= 0;
 
-        if (err < 0) {
-            fprintf(stderr, "PA mainloop quit while iterate for init PA: %d (%d events processed)\n", err, processed);
-            deinit();
-            return false;
-        }
-    }
-
-    if (state_ != PA_CONTEXT_READY) {
+    if (!connecting) {
         fprintf(stderr, "failed to connect to pulse daemon: %s\n",
                 pa_strerror(pa_context_errno(context_)));
+        retry_later();
+    }
+
+    if (pa_threaded_mainloop_start(mainloop_) < 0) {
+        fprintf(stderr, "failed to start pulse mainloop thread\n");
         deinit();
         return false;
     }
 
-    return true;
+    return connecting;
 }
 
 //
@@ -147,125 +111,299 @@ bool PulseClient::init()
 PulseClient::~PulseClient()
 {
     fprintf(stderr, "goodbye, PA\n");
-    pa_proplist_free(connect_props_);
     deinit();
+    pa_proplist_free(connect_props_);
+
+    if (event_fd_ >= 0) {
+        close(event_fd_);
+    }
 }
 
-void PulseClient::Populate()
+void PulseClient::ProcessEvents()
 {
-    if (state_ != PA_CONTEXT_READY) {
+    uint64_t value;
+
+    if (read(event_fd_, &value, sizeof value) < 0 && errno != EAGAIN) {
+        fprintf(stderr, "failed to read pulse eventfd: %s\n", strerror(errno));
+    }
+
+    if (!mainloop_) {
+        return;
+    }
+
+    pa_threaded_mainloop_lock(mainloop_);
+    const bool reconnect = needs_reconnect_;
+    pa_threaded_mainloop_unlock(mainloop_);
+
+    if (reconnect) {
         fprintf(stderr, "reinit pulseaudio!\n");
 
-        if (!init()) {
+        if (!Connect()) {
             fprintf(stderr, "failed reinit pulseaudio!\n");
-            return;
         }
     }
+}
 
-    if (!populate_server_info()) {
-        return;
+VolumeState PulseClient::GetDefaultSinkVolume()
+{
+    VolumeState state;
+
+    if (!mainloop_) {
+        return state;
     }
 
-    if (!populate_sinks()) {
-        return;
+    pa_threaded_mainloop_lock(mainloop_);
+
+    if (have_default_sink_) {
+        state.valid = true;
+        state.volume = default_sink_.Volume();
+        state.muted = default_sink_.Muted();
     }
+
+    pa_threaded_mainloop_unlock(mainloop_);
+
+    return state;
 }
 
-const Sink *PulseClient::GetDefaultSink() const
+bool PulseClient::SetMute(bool mute)
 {
-    long val;
+    if (!mainloop_) {
+        return false;
+    }
 
-    if (xstrtol(default_sink_.c_str(), &val) == 0) {
-        for (const Sink &device : sinks_) {
-            if (device.Index() == val) {
-                return &device;
-            }
+    pa_threaded_mainloop_lock(mainloop_);
+
+    bool changed = false;
+
+    if (have_default_sink_) {
+        pa_operation *op = pa_context_set_sink_mute_by_index(context_, default_sink_.index_, mute, nullptr, nullptr);
+
+        if (op) {
+            pa_operation_unref(op);
+            default_sink_.mute_ = mute;
+            changed = true;
+        } else {
+            fprintf(stderr, "failed to set mute: %s\n", pa_strerror(pa_context_errno(context_)));
         }
     }
 
-    // Not the easy way, then
-    vector<const Sink *> res;
+    pa_threaded_mainloop_unlock(mainloop_);
+
+    return changed;
+}
+
+bool PulseClient::ToggleMute()
+{
+    return SetMute(!GetDefaultSinkVolume().muted);
+}
+
+bool PulseClient::ChangeVolume(int percent)
+{
+    if (!mainloop_) {
+        return false;
+    }
+
+    pa_threaded_mainloop_lock(mainloop_);
+
+    bool changed = false;
 
-    for (const Sink &item : sinks_) {
-        if (item.name_.find(default_sink_) != string::npos) {
-            res.push_back(&item);
+    // Don't go above 100% by scrolling, that's what pavucontrol is for. If
+    // it's been set above that there, leave it instead of clamping it down.
+    const bool atMax = percent > 0 && pa_cvolume_max(&default_sink_.volume_) >= PA_VOLUME_NORM;
+
+    if (have_default_sink_ && !atMax) {
+        pa_cvolume volume = default_sink_.volume_;
+        const pa_volume_t step = pa_volume_t(PA_VOLUME_NORM * std::abs(percent) / 100);
+
+        if (percent > 0) {
+            pa_cvolume_inc_clamp(&volume, step, PA_VOLUME_NORM);
+        } else {
+            pa_cvolume_dec(&volume, step);
+        }
+
+        pa_operation *op = pa_context_set_sink_volume_by_index(context_, default_sink_.index_, &volume, nullptr, nullptr);
+
+        if (op) {
+            pa_operation_unref(op);
+            default_sink_.volume_ = volume;
+            default_sink_.volume_percent_ = volume_as_percent(&volume);
+            changed = true;
+        } else {
+            fprintf(stderr, "failed to set volume: %s\n", pa_strerror(pa_context_errno(context_)));
         }
     }
 
-    switch (res.size()) {
-    case 0:
-        return nullptr;
+    pa_threaded_mainloop_unlock(mainloop_);
 
-    case 1:
-        break;
+    return changed;
+}
 
-    default:
-        warnx("warning: ambiguous result for '%s', using '%s'",
-              default_sink_.c_str(), res[0]->name_.c_str());
+void PulseClient::notify()
+{
+    const uint64_t value = 1;
+
+    if (write(event_fd_, &value, sizeof value) < 0 && errno != EAGAIN) {
+        fprintf(stderr, "failed to write pulse eventfd: %s\n", strerror(errno));
+    }
+}
+
+// Called with the mainloop lock held, or before the mainloop is started
+void PulseClient::retry_later()
+{
+    if (retry_event_) {
+        return;
     }
 
-    return res[0];
+    pa_mainloop_api *api = pa_threaded_mainloop_get_api(mainloop_);
+    timeval when;
+    pa_timeval_add(pa_gettimeofday(&when), reconnect_delay_usec);
+
+    retry_event_ = api->time_new(api, &when, retry_cb, this);
 }
 
-bool PulseClient::wait_for_op(pa_operation *op)
+void PulseClient::retry_cb(pa_mainloop_api *api, pa_time_event *event, const struct timeval * /*tv*/, void *raw)
 {
-    int ret = -1;
+    PulseClient *client = static_cast<PulseClient *>(raw);
 
-    while (pa_operation_get_state(op) == PA_OPERATION_RUNNING) {
-        ret = pa_mainloop_iterate(mainloop_, 1, nullptr);
+    api->time_free(event);
+    client->retry_event_ = nullptr;
 
-        if (ret < 0) {
-            fprintf(stderr, "PA error while iterating: %d\n", ret);
-            break;
-        }
+    // Reconnecting has to happen outside the mainloop thread
+    client->needs_reconnect_ = true;
+    client->notify();
+}
 
-        //if (r < 0) {
-        //  fprintf(stderr, "PA mainloop quit: %d %s\n", r, pa_strerror(pa_context_errno(context_)));
-        //  break;
-        //}
+void PulseClient::request_server_info()
+{
+    pa_operation *op = pa_context_get_server_info(context_, server_info_cb, this);
+
+    if (!op) {
+        fprintf(stderr, "unable to get pa_context_get_server_info\n");
+        return;
     }
 
     pa_operation_unref(op);
-
-    return ret != -1;
 }
 
-bool PulseClient::populate_server_info()
+void PulseClient::request_default_sink()
 {
-    pa_operation *op = pa_context_get_server_info(context_,
-                       server_info_cb,
-                       &default_sink_);
+    if (default_sink_name_.empty()) {
+        return;
+    }
+
+    pa_operation *op = pa_context_get_sink_info_by_name(context_, default_sink_name_.c_str(), sink_info_cb, this);
 
     if (!op) {
-        fprintf(stderr, "unable to get pa_context_get_server_info\n");
-        return false;
+        fprintf(stderr, "unable to get pa_context_get_sink_info_by_name\n");
+        return;
     }
 
-    if (!wait_for_op(op)) {
-        printf("pa_context_get_server_info iterate failure");
-        return false;
+    pa_operation_unref(op);
+}
+
+void PulseClient::state_cb(pa_context *context, void *raw)
+{
+    PulseClient *client = static_cast<PulseClient *>(raw);
+
+    switch (pa_context_get_state(context)) {
+    case PA_CONTEXT_READY: {
+        pa_operation *op = pa_context_subscribe(context,
+                                                pa_subscription_mask_t(PA_SUBSCRIPTION_MASK_SINK | PA_SUBSCRIPTION_MASK_SERVER),
+                                                nullptr, nullptr);
+
+        if (op) {
+            pa_operation_unref(op);
+        } else {
+            fprintf(stderr, "failed to subscribe to pulse events: %s\n", pa_strerror(pa_context_errno(context)));
+        }
+
+        client->request_server_info();
+        break;
     }
 
-    return true;
+    // Give it a moment, so we don't spin if it keeps failing
+    case PA_CONTEXT_FAILED:
+    case PA_CONTEXT_TERMINATED:
+        fprintf(stderr, "lost connection to pulse: %s\n", pa_strerror(pa_context_errno(context)));
+        client->have_default_sink_ = false;
+        client->notify();
+        client->retry_later();
+        break;
+
+    default:
+        break;
+    }
 }
 
-bool PulseClient::populate_sinks()
+void PulseClient::subscribe_cb(pa_context * /*context*/, pa_subscription_event_type_t type, uint32_t index, void *raw)
 {
-    sinks_.clear();
-    pa_operation *op = pa_context_get_sink_info_list(
-                           context_, device_info_cb, static_cast<void *>(&sinks_));
+    PulseClient *client = static_cast<PulseClient *>(raw);
 
-    if (!op) {
-        printf("unable to get pa_context_get_sink_info_list");
-        return false;
+    switch (type & PA_SUBSCRIPTION_EVENT_FACILITY_MASK) {
+    case PA_SUBSCRIPTION_EVENT_SERVER:
+        // Default sink might have changed
+        client->request_server_info();
+        break;
+
+    case PA_SUBSCRIPTION_EVENT_SINK:
+        if (!client->have_default_sink_ || index == client->default_sink_.Index()) {
+            client->request_default_sink();
+        }
+
+        break;
+
+    default:
+        break;
     }
+}
 
-    if (!wait_for_op(op)) {
-        printf("populate_sinks iterate failure");
-        return false;
+void PulseClient::server_info_cb(pa_context * /*context*/, const pa_server_info *info, void *raw)
+{
+    PulseClient *client = static_cast<PulseClient *>(raw);
+
+    if (!info || !info->default_sink_name) {
+        return;
     }
 
-    return true;
+    if (client->default_sink_name_ == info->default_sink_name && client->have_default_sink_) {
+        return;
+    }
+
+    client->default_sink_name_ = info->default_sink_name;
+    client->request_default_sink();
+}
+
+void PulseClient::sink_info_cb(pa_context *context, const pa_sink_info *info, int eol, void *raw)
+{
+    PulseClient *client = static_cast<PulseClient *>(raw);
+
+    if (eol < 0) {
+        // The sink disappeared, we'll get told about the new default
+        fprintf(stderr, "%s error: %s\n", __func__, pa_strerror(pa_context_errno(context)));
+        client->have_default_sink_ = false;
+        client->notify();
+        return;
+    }
+
+    if (eol || !info) {
+        return;
+    }
+
+    const Sink sink(info);
+
+    // Always keep the whole volume, or changing it would put back a stale
+    // balance, but only wake up the bar if what it shows changed
+    const bool changed = !client->have_default_sink_ ||
+                         sink.Index() != client->default_sink_.Index() ||
+                         sink.Volume() != client->default_sink_.Volume() ||
+                         sink.Muted() != client->default_sink_.Muted();
+
+    client->default_sink_ = sink;
+    client->have_default_sink_ = true;
+
+    if (changed) {
+        client->notify();
+    }
 }
 
 //
@@ -274,6 +412,7 @@ bool PulseClient::populate_sinks()
 Sink::Sink(const pa_sink_info *info) :
     index_(info->index),
     name_(info->name ? info->name : ""),
+    volume_(info->volume),
     mute_(info->mute)
 {
     volume_percent_ = volume_as_percent(&info->volume);
@@ -27,6 +27,7 @@ public:
         AVAILABLE_YES,
     } Availability;
 
+    Sink() = default;
     Sink(const pa_sink_info *info);
 
     uint32_t Index() const
@@ -49,46 +50,82 @@ public:
 private:
     friend class PulseClient;
 
-    uint32_t index_;
+    uint32_t index_ = PA_INVALID_INDEX;
     string name_;
     string desc_;
-    int volume_percent_;
-    int mute_;
+    pa_cvolume volume_ = {};
+    int volume_percent_ = 0;
+    int mute_ = 0;
     Sink::Availability available_ = Sink::AVAILABLE_UNKNOWN;
 };
 
-struct ServerInfo {
-    string sink;
+// What we show in the bar, copied out from under the lock
+struct VolumeState {
+    bool valid = false;
+    int volume = 0;
+    bool muted = false;
 };
 
+// Runs the pulse mainloop in its own thread and subscribes to sink and
+// server changes, so the default sink volume is only fetched when something
+// actually changed. EventFd() becomes readable whenever that happens.
 class PulseClient
 {
 public:
     PulseClient(string client_name);
     ~PulseClient();
 
-    // Populates all known devices and cards. Any currently known
-    // devices and cards are cleared before the new data is stored.
-    void Populate();
+    // Starts connecting, doesn't wait for the server. If it fails it tries
+    // again in a bit by itself, so add EventFd() either way.
+    bool Connect();
 
-    // Get the default sink
-    const Sink *GetDefaultSink() const;
+    // Readable when the default sink state has changed, add it to the main
+    // loop and call ProcessEvents() when it is.
+    int EventFd() const
+    {
+        return event_fd_;
+    }
+
+    // Clears the event fd and reconnects if we lost the server
+    void ProcessEvents();
+
+    VolumeState GetDefaultSinkVolume();
+
+    // Change the default sink, returns false if nothing was sent: we don't
+    // have one, it's already at 100% when scrolling up, or the request
+    // failed. What GetDefaultSinkVolume() returns is updated right away,
+    // without waiting for the server to tell us.
+    bool SetMute(bool mute);
+    bool ToggleMute();
+    bool ChangeVolume(int percent);
 
 private:
-    bool init();
+    static void state_cb(pa_context *context, void *raw);
+    static void subscribe_cb(pa_context *context, pa_subscription_event_type_t type, uint32_t index, void *raw);
+    static void server_info_cb(pa_context *context, const pa_server_info *info, void *raw);
+    static void sink_info_cb(pa_context *context, const pa_sink_info *info, int eol, void *raw);
+    static void retry_cb(pa_mainloop_api *api, pa_time_event *event, const struct timeval *tv, void *raw);
+
     void deinit();
-    bool wait_for_op(pa_operation *op);
+    void notify();
+    void retry_later();
 
-    bool populate_server_info();
-    bool populate_sinks();
+    // These are called in the pulse thread
+    void request_server_info();
+    void request_default_sink();
 
     string client_name_;
     pa_context *context_ = nullptr;
-    pa_mainloop *mainloop_ = nullptr;
+    pa_threaded_mainloop *mainloop_ = nullptr;
     pa_proplist *connect_props_ = nullptr;
-    vector<Sink> sinks_;
-    std::string default_sink_;
-    pa_context_state state_;
+    pa_time_event *retry_event_ = nullptr;
+    int event_fd_ = -1;
+
+    // Protected by the mainloop lock
+    string default_sink_name_;
+    Sink default_sink_;
+    bool have_default_sink_ = false;
+    bool needs_reconnect_ = false;
 };
 
 // vim: set et ts=2 sw=2:
@@ -0,0 +1,381 @@
+#pragma once
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+// Records everything the modules read (files, time, disk usage, volume, net
+// counters, ...) to a file, so a bar can be replayed exactly later. The
+// file is just a magic followed by records:
+//
+//     uint8 kind length, uint8 unused, uint16 name length, uint32 data length
+//     kind, name, data
+//
+// A "frame" record with a CLOCK_MONOTONIC timestamp starts each frame, and
+// everything before the first one is setup (interfaces, number of CPUs).
+//
+// When replaying the records are looked up by kind and name within the
+// current frame, in the order they were recorded, so it doesn't matter if
+// something extra got recorded that isn't read back.
+struct Recorder {
+    ~Recorder()
+    {
+        if (fd >= 0) {
+            flush();
+            close(fd);
+        }
+
+        if (mismatches) {
+            fprintf(stderr, "replay: %zu inputs missing from the recording\n", mismatches);
+        }
+    }
+
+    bool startRecording(const char *path)
+    {
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+
+        if (fd < 0) {
+            fprintf(stderr, "Failed to open %s for recording: %s\n", path, strerror(errno));
+            return false;
+        }
+
+        pending.insert(pending.end(), magic, magic + sizeof magic);
+        mode = Recording;
+        return flush();
+    }
+
+    bool startReplay(const char *path)
+    {
+        const int file = open(path, O_RDONLY | O_CLOEXEC);
+
+        if (file < 0) {
+            fprintf(stderr, "Failed to open %s for replay: %s\n", path, strerror(errno));
+            return false;
+        }
+
+        char chunk[65536];
+        ssize_t ret;
+
+        while ((ret = read(file, chunk, sizeof chunk)) > 0 || (ret < 0 && errno == EINTR)) {
+            if (ret > 0) {
+                replayData.insert(replayData.end(), chunk, chunk + ret);
+            }
+        }
+
+        close(file);
+
+        if (ret < 0) {
+            fprintf(stderr, "Failed to read %s: %s\n", path, strerror(errno));
+            return false;
+        }
+
+        if (replayData.size() < sizeof magic || memcmp(replayData.data(), magic, sizeof magic) != 0) {
+            fprintf(stderr, "%s is not a recording\n", path);
+            return false;
+        }
+
+        replayOffset = sizeof magic;
+        mode = Replaying;
+
+        loadRecords(true, nullptr);
+        return true;
+    }
+
+    bool recording() const
+    {
+        return mode == Recording && !paused;
+    }
+
+    bool replaying() const
+    {
+        return mode == Replaying;
+    }
+
+    // Records are written out at the start and end of each frame
+    void beginFrame()
+    {
+        if (!recording()) {
+            return;
+        }
+
+        flush();
+
+        timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        const int64_t timestamp = int64_t(now.tv_sec) * 1000000000LL + now.tv_nsec;
+        append("frame", "", &timestamp, sizeof timestamp);
+    }
+
+    void endFrame()
+    {
+        if (recording()) {
+            flush();
+        }
+    }
+
+    // Loads the next frame when replaying, returns false when there are no
+    // more.
+    bool nextFrame(int64_t *timestamp)
+    {
+        return loadRecords(false, timestamp);
+    }
+
+    // Records the value, or replaces it with the recorded one when replaying
+    template<typename T>
+    void value(std::string_view kind, std::string_view name, T *value)
+    {
+        static_assert(std::is_trivially_copyable_v<T>);
+
+        if (recording()) {
+            append(kind, name, value, sizeof *value);
+        } else if (replaying()) {
+            const Record *record = find(kind, name);
+
+            if (record && record->length == sizeof *value) {
+                memcpy(value, record->data, sizeof *value);
+            }
+        }
+    }
+
+    // Only calls live() if we're not replaying
+    template<typename Function>
+    auto capture(std::string_view kind, std::string_view name, Function &&live)
+    {
+        decltype(live()) result{};
+
+        if (!replaying()) {
+            result = live();
+        }
+
+        value(kind, name, &result);
+        return result;
+    }
+
+    void strings(std::string_view kind, std::string_view name, std::vector<std::string> *strings)
+    {
+        if (recording()) {
+            std::string joined;
+
+            for (const std::string &string : *strings) {
+                joined += string;
+                joined += '\0';
+            }
+
+            append(kind, name, joined.data(), joined.size());
+        } else if (replaying()) {
+            const Record *record = find(kind, name);
+
+            if (!record) {
+                return;
+            }
+
+            strings->clear();
+
+            for (const char *string = record->data; string < record->data + record->length; string += strlen(string) + 1) {
+                strings->emplace_back(string);
+            }
+        }
+    }
+
+    // contents is nullptr if the read failed, then the errno is recorded
+    void recordFile(std::string_view path, const char *contents, size_t length, int error)
+    {
+        if (!recording()) {
+            return;
+        }
+
+        if (contents) {
+            // Keep the terminator, so we can return it directly when replaying
+            append("file", path, contents, length + 1);
+        } else {
+            append("ferr", path, &error, sizeof error);
+        }
+    }
+
+    const char *replayFile(std::string_view path, size_t *length)
+    {
+        for (Record &record : frame) {
+            if (record.used || record.name != path || (record.kind != "file" && record.kind != "ferr")) {
+                continue;
+            }
+
+            record.used = true;
+
+            if (record.kind == "ferr" || record.length == 0) {
+                int error = EIO;
+
+                if (record.length == sizeof error) {
+                    memcpy(&error, record.data, sizeof error);
+                }
+
+                errno = error;
+                return nullptr;
+            }
+
+            *length = record.length - 1;
+            return record.data;
+        }
+
+        mismatches++;
+        errno = ENOENT;
+        return nullptr;
+    }
+
+    // For things we read just to find what to record
+    struct Pause {
+        explicit Pause(Recorder *recorder) :
+            recorder(recorder),
+            wasPaused(recorder->paused)
+        {
+            recorder->paused = true;
+        }
+
+        ~Pause()
+        {
+            recorder->paused = wasPaused;
+        }
+
+        Recorder *recorder;
+        bool wasPaused;
+    };
+
+private:
+    // Everything up to the next frame, or up to the first one for setup
+    bool loadRecords(bool setup, int64_t *timestamp)
+    {
+        frame.clear();
+
+        while (replayOffset + sizeof(Header) <= replayData.size()) {
+            Header header;
+            memcpy(&header, replayData.data() + replayOffset, sizeof header);
+
+            const size_t size = sizeof header + header.kindLength + header.nameLength + header.dataLength;
+
+            if (replayOffset + size > replayData.size()) {
+                fprintf(stderr, "replay: recording is truncated\n");
+                replayOffset = replayData.size();
+                break;
+            }
+
+            const char *start = replayData.data() + replayOffset + sizeof header;
+
+            Record record;
+            record.kind = std::string_view(start, header.kindLength);
+            record.name = std::string_view(start + header.kindLength, header.nameLength);
+            record.data = start + header.kindLength + header.nameLength;
+            record.length = header.dataLength;
+
+            // Leave it for the next call
+            if (record.kind == "frame" && (setup || !frame.empty())) {
+                return true;
+            }
+
+            replayOffset += size;
+
+            if (record.kind == "frame" && record.length == sizeof *timestamp) {
+                memcpy(timestamp, record.data, sizeof *timestamp);
+            }
+
+            frame.push_back(record);
+        }
+
+        return !frame.empty();
+    }
+
+    static constexpr char magic[8] = { 's', 't', 'a', 't', 'r', 'e', 'c', '1' };
+
+    enum Mode {
+        Off,
+        Recording,
+        Replaying
+    };
+
+    struct Header {
+        uint8_t kindLength;
+        uint8_t unused;
+        uint16_t nameLength;
+        uint32_t dataLength;
+    };
+
+    struct Record {
+        std::string_view kind;
+        std::string_view name;
+        const char *data = nullptr;
+        uint32_t length = 0;
+        bool used = false;
+    };
+
+    void append(std::string_view kind, std::string_view name, const void *data, size_t length)
+    {
+        Header header = {};
+        header.kindLength = kind.size();
+        header.nameLength = name.size();
+        header.dataLength = length;
+
+        const char *headerBytes = reinterpret_cast<const char *>(&header);
+        pending.insert(pending.end(), headerBytes, headerBytes + sizeof header);
+        pending.insert(pending.end(), kind.begin(), kind.end());
+        pending.insert(pending.end(), name.begin(), name.end());
+        pending.insert(pending.end(), static_cast<const char *>(data), static_cast<const char *>(data) + length);
+    }
+
+    bool flush()
+    {
+        size_t written = 0;
+
+        while (written < pending.size()) {
+            const ssize_t ret = write(fd, pending.data() + written, pending.size() - written);
+
+            if (ret < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+
+                fprintf(stderr, "Failed to write recording, stopping: %s\n", strerror(errno));
+                mode = Off;
+                pending.clear();
+                return false;
+            }
+
+            written += ret;
+        }
+
+        pending.clear();
+        return true;
+    }
+
+    const Record *find(std::string_view kind, std::string_view name)
+    {
+        for (Record &record : frame) {
+            if (!record.used && record.kind == kind && record.name == name) {
+                record.used = true;
+                return &record;
+            }
+        }
+
+        mismatches++;
+        return nullptr;
+    }
+
+    Mode mode = Off;
+    bool paused = false;
+
+    int fd = -1;
+    std::vector<char> pending;
+
+    std::vector<char> replayData;
+    size_t replayOffset = 0;
+    std::vector<Record> frame;
+    size_t mismatches = 0;
+};
+
+inline Recorder g_recorder;
@@ -0,0 +1,220 @@
+#pragma once
+
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#include <algorithm>
+
+// Fixed size log-linear histogram, 8 buckets for each power of two of
+// nanoseconds, so recording is just a couple of instructions and never
+// allocates. Good to about 12%, which is plenty for finding the slow one.
+struct LatencyHistogram {
+    void add(uint64_t ns)
+    {
+        buckets[bucketIndex(ns)]++;
+        count++;
+        max = std::max(max, ns);
+    }
+
+    // Upper bound of the bucket the percentile falls in
+    uint64_t percentile(double percent) const
+    {
+        if (!count) {
+            return 0;
+        }
+
+        const uint64_t wanted = std::max<uint64_t>(1, uint64_t(count * percent / 100.0 + 0.5));
+        uint64_t seen = 0;
+
+        for (unsigned i = 0; i < bucketCount; i++) {
+            seen += buckets[i];
+
+            if (seen >= wanted) {
+                return std::min(bucketStart(i + 1), max);
+            }
+        }
+
+        return max;
+    }
+
+    uint64_t count = 0;
+    uint64_t max = 0;
+
+private:
+    // Up to 2^41 ns, about 36 minutes, anything above goes in the last one
+    static constexpr unsigned maxExponent = 41;
+    static constexpr unsigned bucketCount = (maxExponent - 2) * 8;
+
+    static unsigned bucketIndex(uint64_t ns)
+    {
+        if (ns < 8) {
+            return ns;
+        }
+
+        const unsigned exponent = 63 - __builtin_clzll(ns);
+
+        if (exponent >= maxExponent) {
+            return bucketCount - 1;
+        }
+
+        return (exponent - 2) * 8 + ((ns >> (exponent - 3)) & 7);
+    }
+
+    static uint64_t bucketStart(unsigned index)
+    {
+        if (index < 8) {
+            return index;
+        }
+
+        return uint64_t(8 + index % 8) << (index / 8 - 1);
+    }
+
+    uint64_t buckets[bucketCount] = {};
+};
+
+inline uint64_t monotonic_now_ns()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+// How long each part of a frame takes, and how often we make the kernel do
+// something for us.
+struct SelfStats {
+    enum Phase {
+        Notification,
+        Battery,
+        Disks,
+        DiskIo,
+        NetRead,
+        Net,
+        Wifi,
+        Load,
+        Pressure,
+        Mem,
+        Cpu,
+        ProcScan,
+        Volume,
+        Date,
+        Clock,
+        Debug,
+        Frame,
+        Write,
+        Wait,
+        PhaseCount
+    };
+
+    static constexpr const char *phaseNames[PhaseCount] = {
+        "notification", "battery", "disks", "diskio", "net read", "net", "wifi", "load",
+        "pressure", "mem", "cpu", "procscan", "volume", "date", "time", "debug", "frame", "write", "wait"
+    };
+
+    void add(Phase phase, uint64_t ns)
+    {
+        histograms[phase].add(ns);
+    }
+
+    // Only counts our own calls in the paths that run every frame
+    uint64_t reads = 0;
+    uint64_t writes = 0;
+    uint64_t netlinkCalls = 0;
+    uint64_t epollWaits = 0;
+    uint64_t timerTicks = 0;
+    uint64_t skippedFrames = 0;
+
+    LatencyHistogram histograms[PhaseCount];
+
+    // Every epoll_wait() is a wakeup, except the first one
+    void countWakeup()
+    {
+        epollWaits++;
+
+        const uint64_t now = monotonic_now_ns();
+
+        if (!minuteStartNs) {
+            minuteStartNs = now;
+            minuteStartWakeups = epollWaits;
+        } else if (now - minuteStartNs >= 60000000000ULL) {
+            lastMinuteWakeups = double(epollWaits - minuteStartWakeups) * 60e9 / (now - minuteStartNs);
+            minuteStartNs = now;
+            minuteStartWakeups = epollWaits;
+        }
+    }
+
+    // Over the last full minute, or so far if we haven't been running that long
+    double wakeupsPerMinute() const
+    {
+        if (lastMinuteWakeups >= 0 || !minuteStartNs) {
+            return std::max(lastMinuteWakeups, 0.);
+        }
+
+        const uint64_t elapsed = monotonic_now_ns() - minuteStartNs;
+        return elapsed ? double(epollWaits - minuteStartWakeups) * 60e9 / elapsed : 0;
+    }
+
+    void dump(FILE *out) const
+    {
+        const uint64_t frames = histograms[Frame].count;
+
+        fprintf(out, "%-12s %8s %10s %10s %10s\n", "phase", "count", "p50 us", "p99 us", "max us");
+
+        for (unsigned i = 0; i < PhaseCount; i++) {
+            const LatencyHistogram &histogram = histograms[i];
+
+            if (!histogram.count) {
+                continue;
+            }
+
+            fprintf(out, "%-12s %8lu %10.1f %10.1f %10.1f\n", phaseNames[i], (unsigned long)histogram.count,
+                    histogram.percentile(50) / 1000.0, histogram.percentile(99) / 1000.0, histogram.max / 1000.0);
+        }
+
+        rusage usage = {};
+        getrusage(RUSAGE_SELF, &usage);
+
+        fprintf(out, "syscalls: %lu reads, %lu writes, %lu netlink, %lu epoll waits",
+                (unsigned long)reads, (unsigned long)writes, (unsigned long)netlinkCalls, (unsigned long)epollWaits);
+
+        if (frames) {
+            fprintf(out, " (%.1f per frame)", double(reads + writes + netlinkCalls + epollWaits) / frames);
+        }
+
+        fprintf(out, "\nwakeups: %lu (%.1f per minute), %lu from the timer, %ld voluntary and %ld involuntary context switches\n",
+                (unsigned long)epollWaits, wakeupsPerMinute(), (unsigned long)timerTicks, usage.ru_nvcsw, usage.ru_nivcsw);
+        fprintf(out, "frames: %lu, %lu not written because nothing changed\n",
+                (unsigned long)frames, (unsigned long)skippedFrames);
+    }
+
+private:
+    uint64_t minuteStartNs = 0;
+    uint64_t minuteStartWakeups = 0;
+    double lastMinuteWakeups = -1;
+};
+
+inline SelfStats g_stats;
+
+// Set from the SIGUSR1 handler
+inline volatile sig_atomic_t g_dumpStats = 0;
+
+// Times the scope into one of the phases
+struct PhaseTimer {
+    explicit PhaseTimer(SelfStats::Phase phase) :
+        phase(phase),
+        start(monotonic_now_ns())
+    {}
+
+    ~PhaseTimer()
+    {
+        g_stats.add(phase, monotonic_now_ns() - start);
+    }
+
+    PhaseTimer(const PhaseTimer &) = delete;
+    PhaseTimer &operator=(const PhaseTimer &) = delete;
+
+    const SelfStats::Phase phase;
+    const uint64_t start;
+};
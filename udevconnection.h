@@ -3,6 +3,10 @@
 #include <libudev.h>
 
 #include <algorithm>
+#include <cmath>
+#include <string>
+#include <string_view>
+#include <vector>
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -89,47 +93,17 @@ struct UdevConnection {
                 continue;
             }
 
-            const char *deviceName = udev_device_get_sysname(dev);
-
-            if (strcmp(deviceName, "BAT0") == 0) {
-                power.batteryDevice = dev; // so we get updates when waking from sleep
-            } else if (strcmp(deviceName, "AC") == 0) {
-                power.chargerDevice = dev;
-            } else {
-                fprintf(stderr, "Unknown power supply device %s\n", deviceName);
-                printProperties(dev);
-                udev_device_unref(dev);
-            }
-
+            updateSupply(dev);
+            udev_device_unref(dev);
         }
 
         udev_enumerate_unref(enumerate);
 
-        power.valid = false;
-
-        if (!power.chargerDevice) {
-            fprintf(stderr, "Failed to find charger device\n");
-            return;
-        }
-
-        if (!updateCharger()) {
-            fprintf(stderr, "Failed to update charger\n");
-            return;
-        }
-
-        power.valid = true;
+        aggregatePower();
     }
 
     ~UdevConnection()
     {
-        if (power.chargerDevice) {
-            udev_device_unref(power.chargerDevice);
-        }
-
-        if (power.batteryDevice) {
-            udev_device_unref(power.batteryDevice);
-        }
-
         if (udevMonitor) {
             udev_monitor_unref(udevMonitor);
         }
@@ -153,6 +127,8 @@ struct UdevConnection {
         }
     }
 
+    // The events come with all the power supply properties, so there's
+    // nothing to read when we get one.
     bool update(const bool gotEvent)
     {
         if (!udevAvailable) {
@@ -160,78 +136,245 @@ struct UdevConnection {
             return false;
         }
 
-        if (gotEvent) {
-            udev_device *dev = udev_monitor_receive_device(udevMonitor);
-
-            const char *deviceName = udev_device_get_sysname(dev);
+        if (!gotEvent) {
+            return true;
+        }
 
-            if (strcmp(deviceName, "BAT0") == 0) {
-                if (dev != power.batteryDevice) {
-                    if (power.batteryDevice) {
-                        udev_device_unref(power.batteryDevice);
-                    }
+        udev_device *dev = udev_monitor_receive_device(udevMonitor);
 
-                    power.batteryDevice = dev;
-                }
-            } else if (strcmp(deviceName, "AC") == 0) {
-                if (dev != power.chargerDevice) {
-                    if (power.chargerDevice) {
-                        udev_device_unref(power.chargerDevice);
-                    }
-
-                    power.chargerDevice = dev;
-                }
-            } else {
-                fprintf(stderr, "Unknown power supply device notification %s\n", deviceName);
-            }
+        if (!dev) {
+            fprintf(stderr, "Failed to receive udev event: %s\n", strerror(errno));
+            return false;
         }
 
-        power.valid = updateCharger();
+        const char *action = udev_device_get_action(dev);
 
-        if (!power.valid) {
-            power.chargerOnline = false;
+        if (action && strcmp(action, "remove") == 0) {
+            removeSupply(udev_device_get_sysname(dev));
+        } else {
+            updateSupply(dev);
         }
 
+        udev_device_unref(dev);
+        aggregatePower();
         return true;
     }
 
-    bool updateCharger()
+    // In case we missed an event, e. g. while suspended. Makes udev read the
+    // uevent files again, which has the current values.
+    void rereadPower()
     {
-        if (!power.chargerDevice) {
-            //fprintf(stderr, "charger not available?\n");
-            return false;
+        if (!udevAvailable) {
+            return;
         }
 
-        const char *online = udev_device_get_property_value(power.chargerDevice, "POWER_SUPPLY_ONLINE");
+        for (size_t i = 0; i < power.supplies.size();) {
+            udev_device *dev = udev_device_new_from_syspath(context, power.supplies[i].syspath.c_str());
 
-        if (strcmp(online, "1") == 0) {
-            power.chargerOnline = true;
-        } else if (strcmp(online, "0") == 0) {
-            power.chargerOnline = false;
-        } else {
-            fprintf(stderr, "unknown charger online %s\n", online);
+            // Gone without telling us
+            if (!dev) {
+                power.supplies.erase(power.supplies.begin() + i);
+                continue;
+            }
+
+            updateSupply(dev);
+            udev_device_unref(dev);
+            i++;
         }
 
-        return true;
+        aggregatePower();
     }
 
-    udev *context = nullptr;
-    udev_monitor *udevMonitor = nullptr;
+    struct PowerSupply {
+        std::string name;
+        std::string syspath;
+        bool battery = false;
 
-    bool udevAvailable = false;
+        // Chargers
+        bool online = false;
 
-    int udevSocketFd = -1;
+        // Batteries
+        bool charging = false;
+        int capacity = -1;
+
+        // µWh it has and can hold, and µW it's using or getting, 0 if unknown
+        double energy = 0;
+        double full = 0;
+        double powerNow = 0;
+    };
+
+    // The batteries together, all 0 unless all of them tell us
+    struct Energy {
+        double now = 0;
+        double full = 0;
+        double powerNow = 0;
+    };
 
     struct PowerStatus {
-        udev_device *chargerDevice = nullptr;
-        udev_device *batteryDevice = nullptr; // don't use this or trust this, udev is shit
+        std::vector<PowerSupply> supplies;
 
+        // All of them together
         bool chargerOnline = false;
+        int percentage = -1;
+        Energy energy;
+
         int last_percentage = 100;
-        bool valid = false;
+        bool valid = false; // if we have any batteries
     } power;
 
+    udev *context = nullptr;
+    udev_monitor *udevMonitor = nullptr;
+
+    bool udevAvailable = false;
+
+    int udevSocketFd = -1;
+
     std::vector<std::string> wlanInterfaces;
     std::vector<std::string> ethernetInterfaces;
+
+private:
+    static const char *property(udev_device *dev, const char *name)
+    {
+        const char *value = udev_device_get_property_value(dev, name);
+        return value ? value : "";
+    }
+
+    static double number(udev_device *dev, const char *name)
+    {
+        const char *value = udev_device_get_property_value(dev, name);
+        return value ? atof(value) : 0;
+    }
+
+    void updateSupply(udev_device *dev)
+    {
+        const char *name = udev_device_get_sysname(dev);
+        const char *syspath = udev_device_get_syspath(dev);
+        const std::string_view type = property(dev, "POWER_SUPPLY_TYPE");
+
+        // Mice, headphones and such have batteries too
+        if (!name || !syspath || strcmp(property(dev, "POWER_SUPPLY_SCOPE"), "Device") == 0) {
+            return;
+        }
+
+        const bool battery = type == "Battery";
+
+        if (!battery && !udev_device_get_property_value(dev, "POWER_SUPPLY_ONLINE")) {
+            return;
+        }
+
+        auto it = std::find_if(power.supplies.begin(), power.supplies.end(), [&](const PowerSupply &supply) {
+            return supply.name == name;
+        });
+
+        if (it == power.supplies.end()) {
+            it = power.supplies.insert(power.supplies.end(), PowerSupply());
+            it->name = name;
+            it->syspath = syspath;
+        }
+
+        it->battery = battery;
+
+        if (!battery) {
+            it->online = strcmp(property(dev, "POWER_SUPPLY_ONLINE"), "1") == 0;
+            return;
+        }
+
+        // Not plugged into its slot
+        if (strcmp(property(dev, "POWER_SUPPLY_PRESENT"), "0") == 0) {
+            it->capacity = -1;
+            return;
+        }
+
+        const std::string_view status = property(dev, "POWER_SUPPLY_STATUS");
+        it->charging = status == "Charging" || status == "Full";
+
+        // Some only have the charge and current, not the energy and power,
+        // then the voltage makes them comparable
+        double now = number(dev, "POWER_SUPPLY_ENERGY_NOW");
+        double full = number(dev, "POWER_SUPPLY_ENERGY_FULL");
+        double powerNow = number(dev, "POWER_SUPPLY_POWER_NOW");
+
+        if (full <= 0) {
+            // µV, and the charge is in µAh while the energy is in µWh
+            const double voltage = number(dev, "POWER_SUPPLY_VOLTAGE_MIN_DESIGN") / 1000000;
+            now = number(dev, "POWER_SUPPLY_CHARGE_NOW") * (voltage > 0 ? voltage : 1);
+            full = number(dev, "POWER_SUPPLY_CHARGE_FULL") * (voltage > 0 ? voltage : 1);
+        }
+
+        if (powerNow <= 0) {
+            powerNow = number(dev, "POWER_SUPPLY_CURRENT_NOW") * number(dev, "POWER_SUPPLY_VOLTAGE_NOW") / 1000000;
+        }
+
+        it->energy = full > 0 ? now : 0;
+        it->full = full > 0 ? full : 0;
+        it->powerNow = std::abs(powerNow); // some report it negative when discharging
+
+        if (const char *capacity = udev_device_get_property_value(dev, "POWER_SUPPLY_CAPACITY")) {
+            it->capacity = atoi(capacity);
+        } else if (full > 0) {
+            it->capacity = int(now * 100 / full + 0.5);
+        } else {
+            it->capacity = -1;
+        }
+    }
+
+    void removeSupply(const char *name)
+    {
+        if (!name) {
+            return;
+        }
+
+        power.supplies.erase(std::remove_if(power.supplies.begin(), power.supplies.end(), [&](const PowerSupply &supply) {
+            return supply.name == name;
+        }), power.supplies.end());
+    }
+
+    // One percentage for all the batteries, weighted by how much they hold
+    // (or just the average if we don't know), and on the charger if any of
+    // them are
+    void aggregatePower()
+    {
+        double weighted = 0;
+        Energy energy;
+        int sum = 0, batteries = 0;
+        bool haveCharger = false, chargerOnline = false, charging = false;
+        bool allWeighted = true;
+
+        for (const PowerSupply &supply : power.supplies) {
+            if (!supply.battery) {
+                haveCharger = true;
+                chargerOnline = chargerOnline || supply.online;
+                continue;
+            }
+
+            if (supply.capacity < 0) {
+                continue;
+            }
+
+            batteries++;
+            sum += supply.capacity;
+            charging = charging || supply.charging;
+            weighted += supply.capacity * supply.full;
+            energy.now += supply.energy;
+            energy.full += supply.full;
+            energy.powerNow += supply.powerNow;
+            allWeighted = allWeighted && supply.full > 0;
+        }
+
+        power.valid = batteries > 0;
+
+        if (!power.valid) {
+            power.percentage = -1;
+            power.energy = Energy();
+            power.chargerOnline = chargerOnline;
+            return;
+        }
+
+        power.percentage = allWeighted ? int(weighted / energy.full + 0.5) : (sum + batteries / 2) / batteries;
+        power.energy = allWeighted ? energy : Energy();
+
+        // Without a charger device, go by what the batteries say
+        power.chargerOnline = haveCharger ? chargerOnline : charging;
+    }
 };
 
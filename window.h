@@ -0,0 +1,191 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <cmath>
+
+// Small fixed size containers for smoothing samples, so the modules don't
+// each have their own arrays to memmove around. None of them allocate, and
+// adding a sample is O(1).
+
+// The last Size samples, with a running sum.
+template<typename T, unsigned Size>
+struct SlidingWindow {
+    static_assert(Size > 0, "SlidingWindow needs room for at least one sample");
+
+    void push(T value)
+    {
+        if (count == Size) {
+            total -= values[next];
+        } else {
+            count++;
+        }
+
+        values[next] = value;
+        total += value;
+        next = (next + 1) % Size;
+    }
+
+    T sum() const
+    {
+        return total;
+    }
+
+    double mean() const
+    {
+        return count ? double(total) / count : 0;
+    }
+
+    T newest() const
+    {
+        return values[(next + Size - 1) % Size];
+    }
+
+    T oldest() const
+    {
+        return count < Size ? values[0] : values[next];
+    }
+
+    unsigned size() const
+    {
+        return count;
+    }
+
+    bool empty() const
+    {
+        return count == 0;
+    }
+
+    void clear()
+    {
+        count = 0;
+        next = 0;
+        total = T();
+    }
+
+private:
+    T values[Size] = {};
+    T total = T();
+    unsigned count = 0;
+    unsigned next = 0;
+};
+
+// Exponentially weighted moving average, weighted by how much time has
+// passed since the last sample instead of per sample, so it smooths the same
+// when we sample less often. After TimeConstantMs a change is about 63% of
+// the way in.
+template<unsigned TimeConstantMs>
+struct Ewma {
+    double add(double sample, uint64_t elapsedMs)
+    {
+        if (!valid || !TimeConstantMs) {
+            current = sample;
+            valid = true;
+            return current;
+        }
+
+        const double alpha = 1.0 - std::exp(-double(elapsedMs) / TimeConstantMs);
+        current += alpha * (sample - current);
+        return current;
+    }
+
+    double value() const
+    {
+        return current;
+    }
+
+    void clear()
+    {
+        valid = false;
+        current = 0;
+    }
+
+private:
+    double current = 0;
+    bool valid = false;
+};
+
+// Minimum (or maximum, with Compare = std::greater) of the samples from the
+// last SpanMs milliseconds, and of any shorter span than that. Keeps a
+// monotonic queue, so it only remembers the samples that can still be the
+// answer, and Capacity only needs to cover the span at the fastest rate we
+// sample at; if it fills up the oldest ones are dropped.
+template<typename T, unsigned Capacity, uint64_t SpanMs, typename Compare>
+struct WindowedMinMax {
+    void push(uint64_t timeMs, T value)
+    {
+        if (!started) {
+            startMs = timeMs;
+            started = true;
+        }
+
+        // Anything worse than the new one can't be the answer anymore
+        while (count && !compare(at(count - 1).value, value)) {
+            count--;
+        }
+
+        if (count == Capacity) {
+            first = (first + 1) % Capacity;
+            count--;
+            startMs = at(0).time;
+        }
+
+        at(count++) = { timeMs, value };
+
+        // Too old
+        while (count > 1 && at(0).time + SpanMs < timeMs) {
+            first = (first + 1) % Capacity;
+            count--;
+        }
+    }
+
+    // Of the samples from the last spanMs before nowMs, or fallback if there
+    // aren't any
+    T get(uint64_t nowMs, uint64_t spanMs, T fallback) const
+    {
+        for (unsigned i = 0; i < count; i++) {
+            if (at(i).time + spanMs >= nowMs) {
+                return at(i).value;
+            }
+        }
+
+        return fallback;
+    }
+
+    // If we have been sampling for at least that long, so the answer is for
+    // the whole span
+    bool covers(uint64_t nowMs, uint64_t spanMs) const
+    {
+        return started && startMs + spanMs <= nowMs;
+    }
+
+    void clear()
+    {
+        count = 0;
+        first = 0;
+        started = false;
+    }
+
+private:
+    struct Sample {
+        uint64_t time;
+        T value;
+    };
+
+    Sample &at(unsigned index)
+    {
+        return samples[(first + index) % Capacity];
+    }
+
+    const Sample &at(unsigned index) const
+    {
+        return samples[(first + index) % Capacity];
+    }
+
+    Sample samples[Capacity] = {};
+    unsigned first = 0;
+    unsigned count = 0;
+    uint64_t startMs = 0;
+    bool started = false;
+    Compare compare;
+};